@@ -0,0 +1,117 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+# Generates a Rails-like Ruby monorepo for indexing benchmarks. The same
+# options always produce the same tree. It has
+#
+# - engines under components/ with models, controllers, services and jobs
+#   nested in modules several levels deep
+# - classes declared with compact `Foo::Bar::Baz` paths
+# - a set of core classes reopened from hundreds of files, like concerns and
+#   monkey patches do
+# - a few very large files
+#
+#   ruby bench/gen_corpus.rb [--files=10000] [--seed=1] <output dir>
+
+require 'fileutils'
+require 'optparse'
+
+options = { files: 10_000, seed: 1 }
+OptionParser.new do |opts|
+  opts.banner = 'Usage: ruby bench/gen_corpus.rb [options] <output dir>'
+  opts.on('--files=N', Integer, 'Number of .rb files') { |n| options[:files] = n }
+  opts.on('--seed=N', Integer, 'Random seed') { |n| options[:seed] = n }
+end.parse!
+root = ARGV.fetch(0) { abort 'No output directory given' }
+
+WORDS = %w[
+  account address audit billing cart catalog charge checkout comment coupon customer delivery
+  discount document event export feed import inventory invoice ledger message notification
+  order payment permission plan price product profile refund report review role schedule
+  search session shipment subscription tag tax team ticket token upload user vendor webhook
+].freeze
+KINDS = {
+  'models' => 'ApplicationRecord',
+  'controllers' => 'ApplicationController',
+  'services' => nil,
+  'jobs' => 'ApplicationJob',
+  'serializers' => nil
+}.freeze
+CORE_CLASSES = %w[User Account Order Product Payment].freeze
+LARGE_FILE_SHARE = 0.002
+LARGE_FILE_METHODS = 4000
+
+def camelize(word)
+  word.split('_').map(&:capitalize).join
+end
+
+def method_body(random, names)
+  calls = Array.new(random.rand(1..4)) do
+    case random.rand(4)
+    when 0 then "#{names.sample(random: random)}.find(id)"
+    when 1 then "#{names.sample(random: random)}::Base.new(attributes).call"
+    when 2 then "@#{WORDS.sample(random: random)} ||= []"
+    else "Rails.logger.info(\"#{WORDS.sample(random: random)}\")"
+    end
+  end
+  calls.map { |call| "    #{call}\n" }.join
+end
+
+def methods_source(random, count, names, indent)
+  Array.new(count) do |i|
+    body = method_body(random, names).gsub(/^/, '  ' * indent)
+    "#{'  ' * indent}  def #{WORDS.sample(random: random)}_#{i}(id, attributes = {})\n" \
+      "#{body}#{'  ' * indent}  end\n"
+  end.join("\n")
+end
+
+# Nested `module` blocks around the class, or one compact path
+def class_source(random, namespaces, name, superclass, body_methods, names)
+  inheritance = superclass ? " < #{superclass}" : ''
+  if random.rand < 0.4
+    path = (namespaces + [name]).join('::')
+    "class #{path}#{inheritance}\n#{methods_source(random, body_methods, names, 0)}end\n"
+  else
+    opening = namespaces.each_with_index.map { |ns, depth| "#{'  ' * depth}module #{ns}\n" }.join
+    closing = namespaces.each_index.reverse_each.map { |depth| "#{'  ' * depth}end\n" }.join
+    indent = namespaces.size
+    "#{opening}#{'  ' * indent}class #{name}#{inheritance}\n" \
+      "#{methods_source(random, body_methods, names, indent)}#{'  ' * indent}end\n#{closing}"
+  end
+end
+
+def reopening_source(random, name, names)
+  "class #{name}\n  include #{camelize(WORDS.sample(random: random))}Concern\n\n" \
+    "#{methods_source(random, random.rand(1..3), names, 0)}end\n"
+end
+
+random = Random.new(options[:seed])
+FileUtils.rm_rf(root)
+names = CORE_CLASSES.dup
+engines = Array.new([options[:files] / 500, 1].max) { |i| "#{WORDS[i % WORDS.size]}_engine_#{i}" }
+
+options[:files].times do |i|
+  engine = engines[i % engines.size]
+  kind, superclass = KINDS.to_a[random.rand(KINDS.size)]
+  depth = random.rand(1..5)
+  segments = Array.new(depth) { WORDS.sample(random: random) }
+  name = "#{camelize(WORDS.sample(random: random))}#{camelize(kind.chomp('s'))}#{i}"
+  dir = File.join(root, 'components', engine, 'app', kind, *segments)
+  FileUtils.mkdir_p(dir)
+
+  source =
+    if i % 20 == 0
+      reopening_source(random, CORE_CLASSES[i / 20 % CORE_CLASSES.size], names)
+    else
+      methods = random.rand < LARGE_FILE_SHARE ? LARGE_FILE_METHODS : random.rand(2..15)
+      namespaces = [camelize(engine)] + segments.map { |segment| camelize(segment) }
+      class_source(random, namespaces, name, superclass, methods, names)
+    end
+  names << name if names.size < 1000
+  File.write(File.join(dir, "#{name.gsub(/([a-z\d])([A-Z])/, '\1_\2').downcase}.rb"), source)
+end
+
+FileUtils.mkdir_p(File.join(root, 'config'))
+File.write(File.join(root, 'Gemfile'), "source 'https://rubygems.org'\n\ngem 'rails'\n")
+File.write(File.join(root, 'config', 'application.rb'), "module Monorepo\n  class Application\n  end\nend\n")
+puts "Generated #{options[:files]} files in #{root}"
@@ -0,0 +1,87 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+# Cold-start indexing benchmark: starts frls over stdio, sends initialize for
+# the workspace and waits for the end of the indexing progress. Reports the
+# wall time, the time to the initialize response, files per second, peak RSS
+# of the server and the index size from frls/stats.
+#
+#   ruby bench/index.rb [--server=build/frls] [--repeat=N] <workspace>
+
+require 'json'
+require 'open3'
+require 'optparse'
+require_relative '../test/integration/lsp_client'
+
+options = { server: File.expand_path('../build/frls', __dir__), repeat: 1 }
+OptionParser.new do |opts|
+  opts.banner = 'Usage: ruby bench/index.rb [options] <workspace>'
+  opts.on('--server=PATH', 'frls binary') { |path| options[:server] = path }
+  opts.on('--repeat=N', Integer, 'Index the workspace N times') { |n| options[:repeat] = n }
+end.parse!
+workspace = File.expand_path(ARGV.fetch(0) { abort 'No workspace given' })
+abort "Server binary not found at #{options[:server]}. Run 'make' first." unless File.exist?(options[:server])
+
+# VmHWM is the peak resident set, it has to be read before the server exits
+def peak_rss_kb(pid)
+  File.read("/proc/#{pid}/status")[/^VmHWM:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  0
+end
+
+def wait_for_indexing(client)
+  loop do
+    message = client.read_response
+    abort 'frls exited while indexing' unless message
+    if message['method'] == 'window/workDoneProgress/create'
+      client.send_message({ jsonrpc: '2.0', id: message['id'], result: nil })
+    elsif message['method'] == '$/progress' && message['params']['value']['kind'] == 'end'
+      return
+    end
+  end
+end
+
+def index_once(server, workspace)
+  stdin, stdout, wait_thread = Open3.popen2(server, '--stdio', err: File::NULL)
+  client = LSPClient.new
+  client.attach(stdout, stdin)
+
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  client.send_request('initialize', { processId: Process.pid, rootUri: "file://#{workspace}",
+                                      clientInfo: { name: 'frls-bench' },
+                                      capabilities: { window: { workDoneProgress: true } } })
+  response = client.read_response
+  initialized = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  abort "initialize failed: #{response.inspect}" unless response && response['result']
+  wait_for_indexing(client)
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+
+  client.send_request('frls/stats', {})
+  stats = client.read_response['result']
+  # files per second of an empty index would say nothing about the indexer
+  abort "No Ruby files indexed in #{workspace}" unless stats['sources'].positive?
+  rss = peak_rss_kb(wait_thread.pid)
+
+  client.send_request('shutdown', {})
+  client.read_response
+  client.send_notification('exit', {})
+  client.disconnect
+  wait_thread.join
+  { elapsed: elapsed, initialized: initialized, sources: stats['sources'], constants: stats['constants'], rss_kb: rss }
+end
+
+runs = Array.new(options[:repeat]) { index_once(options[:server], workspace) }
+runs.each_with_index do |run, i|
+  puts format('run %d: %.3fs (initialize %.1fms), %d files, %.0f files/s, %d constants, peak RSS %.1f MB',
+              i + 1, run[:elapsed], run[:initialized] * 1000, run[:sources], run[:sources] / run[:elapsed],
+              run[:constants], run[:rss_kb] / 1024.0)
+end
+best = runs.min_by { |run| run[:elapsed] }
+puts JSON.generate(
+  wall_seconds: best[:elapsed].round(4),
+  initialize_seconds: best[:initialized].round(4),
+  files: best[:sources],
+  files_per_second: (best[:sources] / best[:elapsed]).round,
+  constants: best[:constants],
+  peak_rss_kb: runs.map { |run| run[:rss_kb] }.max
+)
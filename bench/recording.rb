@@ -0,0 +1,61 @@
+# frozen_string_literal: true
+
+# Sessions recorded with `frls --record=<path>`, see include/record.h. Every
+# message is a header line `<microseconds> <client id> <length>` followed by
+# the body and a newline.
+module Recording
+  MAGIC = "FRLS-RECORDING 1\n"
+
+  Message = Struct.new(:time_us, :client_id, :body)
+
+  # Also reads raw Content-Length framed streams like test/fixtures/*.txt, as
+  # one client sending everything at once
+  def self.read(path)
+    data = File.binread(path)
+    data.start_with?(MAGIC) ? parse_recording(data) : parse_frames(data)
+  end
+
+  def self.parse_recording(data)
+    messages = []
+    offset = MAGIC.bytesize
+    while offset < data.bytesize
+      line_end = data.index("\n", offset)
+      time_us, client_id, length = data.byteslice(offset, line_end - offset).split.map(&:to_i)
+      body = data.byteslice(line_end + 1, length)
+      messages << Message.new(time_us, client_id, body)
+      offset = line_end + 1 + length + 1
+    end
+    messages
+  end
+
+  def self.parse_frames(data)
+    messages = []
+    offset = 0
+    while (header_end = data.index("\r\n\r\n", offset) || data.index("\n\n", offset))
+      headers = data.byteslice(offset, header_end - offset)
+      length = headers[/Content-Length:\s*(\d+)/i, 1].to_i
+      body_start = header_end + (data.byteslice(header_end, 4) == "\r\n\r\n" ? 4 : 2)
+      messages << Message.new(0, 1, data.byteslice(body_start, length))
+      offset = body_start + length
+    end
+    messages
+  end
+
+  # Writes what LSPClient sends in the same format as the server
+  class Writer
+    def initialize(path)
+      @file = File.open(path, 'wb')
+      @file.write(MAGIC)
+      @started = Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+    end
+
+    def write(client_id, body)
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+      @file.write("#{now - @started} #{client_id} #{body.bytesize}\n#{body}\n")
+    end
+
+    def close
+      @file.close
+    end
+  end
+end
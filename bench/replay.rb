@@ -0,0 +1,166 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+# Feeds recorded sessions into a fresh frls and reports latency percentiles
+# per method and the throughput. Recordings come from `frls --record=<path>`,
+# FRLS_RECORD=<dir> test runs, or raw framed messages like test/fixtures/*.txt.
+# Several files are replayed one after another as a single session.
+#
+#   ruby bench/replay.rb [--paced] [--repeat=N] [--server=build/frls] recording...
+#
+# By default messages are sent as fast as possible, --paced keeps the
+# original gaps between them. Every repetition starts a new server.
+
+require 'json'
+require 'optparse'
+require 'socket'
+require_relative 'recording'
+require_relative '../test/integration/lsp_client'
+
+HOST = '127.0.0.1'
+PORT = 7779
+WAIT_TIMEOUT = 30
+# never answered, the ids some fixtures give them are dropped
+NOTIFICATION = %r{\A(initialized|exit|\$/.*|textDocument/did.*|workspace/did.*)\z}
+
+options = { paced: false, repeat: 1, server: File.expand_path('../build/frls', __dir__), port: PORT }
+OptionParser.new do |opts|
+  opts.banner = 'Usage: ruby bench/replay.rb [options] recording...'
+  opts.on('--paced', 'Keep the recorded gaps between messages') { options[:paced] = true }
+  opts.on('--repeat=N', Integer, 'Replay the session N times') { |n| options[:repeat] = n }
+  opts.on('--server=PATH', 'frls binary') { |path| options[:server] = path }
+  opts.on('--port=PORT', Integer, 'Port the server listens on') { |port| options[:port] = port }
+end.parse!
+abort 'No recordings given' if ARGV.empty?
+
+# Consecutive files are shifted so that their timestamps don't overlap
+def load_session(paths)
+  offset = 0
+  paths.flat_map do |path|
+    messages = Recording.read(path)
+    messages.each { |message| message.time_us += offset }
+    offset = messages.last.time_us + 1 unless messages.empty?
+    messages
+  end
+end
+
+# Request ids are renumbered per connection, recordings stitched together from
+# fixtures reuse them. The originals are kept so $/cancelRequest still points
+# at the right request.
+class Connection
+  attr_reader :pending
+
+  def initialize(port, latencies, lock)
+    @client = LSPClient.new(host: HOST, port: port)
+    @client.connect
+    @client.socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+    @latencies = latencies
+    @lock = lock
+    @pending = {}
+    @ids = {}
+    @next_id = 0
+    @reader = Thread.new { read_responses }
+  end
+
+  def deliver(body)
+    message = JSON.parse(body)
+    message.delete('id') if NOTIFICATION.match?(message['method'])
+    if message['method'] && message.key?('id')
+      @next_id += 1
+      @ids[message['id']] = @next_id
+      message['id'] = @next_id
+      @lock.synchronize { @pending[@next_id] = [message['method'], now] }
+    elsif message['method'] == '$/cancelRequest' && message.dig('params', 'id')
+      message['params']['id'] = @ids.fetch(message['params']['id'], message['params']['id'])
+    end
+    @client.send_body(JSON.generate(message))
+  rescue JSON::ParserError
+    @client.send_body(body)
+  end
+
+  def close
+    @client.disconnect
+    @reader.join
+  end
+
+  private
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def read_responses
+    while (message = @client.read_response)
+      next if message['method'] # a request or notification from the server
+
+      @lock.synchronize do
+        method, sent_at = @pending.delete(message['id'])
+        (@latencies[method] ||= []) << now - sent_at if method
+      end
+    end
+  rescue IOError, SystemCallError
+    nil # the session ended with exit or the server is gone
+  end
+end
+
+def start_server(path, port)
+  abort "Server binary not found at #{path}. Run 'make' first." unless File.exist?(path)
+  pid = spawn(path, "--host=#{HOST}", "--port=#{port}", out: File::NULL, err: File::NULL)
+  20.times do
+    TCPSocket.new(HOST, port).close
+    return pid
+  rescue Errno::ECONNREFUSED
+    sleep 0.1
+  end
+  abort 'Server failed to start'
+end
+
+def replay(messages, options, latencies, lock)
+  pid = start_server(options[:server], options[:port])
+  connections = {}
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  messages.each do |message|
+    if options[:paced]
+      delay = started + message.time_us / 1_000_000.0 - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      sleep delay if delay.positive?
+    end
+    connection = connections[message.client_id] ||= Connection.new(options[:port], latencies, lock)
+    connection.deliver(message.body)
+  end
+
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + WAIT_TIMEOUT
+  until connections.values.all? { |connection| lock.synchronize { connection.pending.empty? } }
+    if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+      warn 'Some requests were never answered'
+      break
+    end
+    sleep 0.001
+  end
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+
+  Process.kill('TERM', pid) rescue nil
+  Process.wait(pid) rescue nil
+  connections.each_value(&:close)
+  elapsed
+end
+
+def percentile(sorted, fraction)
+  sorted[[(fraction * sorted.size).ceil - 1, 0].max]
+end
+
+messages = load_session(ARGV)
+latencies = {}
+lock = Mutex.new
+elapsed = Array.new(options[:repeat]) { replay(messages, options, latencies, lock) }.sum
+
+puts format('%-32s %8s %10s %10s %10s', 'method', 'count', 'p50 ms', 'p95 ms', 'p99 ms')
+latencies.sort.each do |method, samples|
+  sorted = samples.sort
+  puts format('%-32s %8d %10.3f %10.3f %10.3f', method, sorted.size,
+              percentile(sorted, 0.50) * 1000, percentile(sorted, 0.95) * 1000,
+              percentile(sorted, 0.99) * 1000)
+end
+total = messages.size * options[:repeat]
+answered = latencies.values.sum(&:size)
+puts format('%d messages, %d requests answered in %.3fs: %.0f messages/s, %.0f requests/s',
+            total, answered, elapsed, total / elapsed, answered / elapsed)
@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+// Address space an arena reserves, pages are committed as they're used
+#define ARENA_RESERVE_SIZE (1024ull * 1024 * 1024)
+// Memory is committed that much at a time, one block stays committed
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+// Bump-pointer allocator for everything that lives exactly one
+// request/response cycle. Nothing is freed individually, `arena_reset`
+// releases the whole cycle at once. The memory is one contiguous range, so
+// telling arena pointers from malloc ones is a bounds check.
+typedef struct {
+  char *base;
+  size_t used;
+  size_t committed;
+} Arena;
+
+Arena *create_arena();
+void *arena_alloc(Arena *arena, size_t size);
+bool arena_owns(Arena *arena, void *ptr);
+void arena_reset(Arena *arena);
+void destroy_arena(Arena *arena);
+
+// cJSON allocates from the arena entered on the current thread and falls back
+// to malloc/free when there is none. Anything that outlives the cycle has to
+// be created with the arena left, `arena_enter(NULL)` does that.
+void install_arena_hooks();
+Arena *arena_enter(Arena *arena);
+
+#endif
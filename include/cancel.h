@@ -0,0 +1,23 @@
+#include "transport.h"
+#include <stdbool.h>
+
+#ifndef CANCEL_H_INCLUDED
+#define CANCEL_H_INCLUDED
+
+// A request submitted to a worker, until the worker is done with it
+typedef struct {
+  const Client *client; // ids are only unique per connection
+  int id;
+  bool cancelled;
+} PendingRequest;
+
+PendingRequest *register_request(Client *client, int id);
+void unregister_request(PendingRequest *pending);
+bool cancel_request(Client *client, int id);
+
+// Long handlers poll the request their thread is running, traversals and
+// scans bail out early once it's cancelled
+PendingRequest *enter_request(PendingRequest *pending);
+bool is_request_cancelled();
+
+#endif
@@ -1,4 +1,5 @@
 #include "cJSON.h"
+#include "log.h"
 #include <stdbool.h>
 #include <sys/types.h>
 
@@ -20,18 +21,52 @@ OPTIONS:\n\
   --version, -v         - Display the version of this program\n\
   --host                - Specify host(default: 127.0.0.1)\n\
   --port                - Specify port(default: 1488)\n\
+  --stdio               - Talk to the client over stdin/stdout instead of TCP\n\
+  --output-high-water   - Stop reading from a client with that many unsent bytes(default: 4MB)\n\
+  --threads             - Number of worker threads running handlers(default: 4)\n\
+  --index-threads       - Number of threads parsing the workspace(default: all cores but one)\n\
+  --git-index           - List the workspace files from .git/index, `all` also walks for untracked ones\n\
+  --debounce            - Milliseconds without changes before a document is reparsed(default: 150)\n\
+  --log-level           - error, warn, info, debug or trace(default: info)\n\
+  --log-file            - Write logs to this file instead of stderr\n\
+  --stats-file          - Write the frls/stats counters and latencies to this file on exit\n\
+  --trace-file          - Write Chrome trace events of indexing and requests to this file\n\
+  --record              - Record every inbound message to this file for bench/replay.rb\n\
 "
 #define HOST "127.0.0.1"
 #define PORT 1488
+#define OUTPUT_HIGH_WATER (4 * 1024 * 1024)
+// 0 runs every handler on the I/O thread
+#define WORKER_THREADS 4
+// 0 reparses on every change
+#define DEBOUNCE_MS 150
+
+typedef enum {
+  GIT_INDEX_OFF, // walk the workspace
+  GIT_INDEX_ON,  // only the files tracked in .git/index, no walk
+  GIT_INDEX_ALL, // the tracked files, then a walk for untracked ones
+} GitIndexMode;
 
 typedef struct {
   uint port;
+  bool stdio;
+  size_t output_high_water;
+  size_t threads;
+  size_t index_threads; // 0 uses every core
+  GitIndexMode git_index;
+  size_t debounce_ms;
+  LogLevel log_level; // $/setTrace raises the level, `off` comes back to this
+  char *log_file;
+  char *stats_file;
+  char *trace_file;
+  char *record_file;
   uint client_process_id;
   char *host;
   char *project_root;
   char *client_name;
   char *client_version;
   cJSON *client_capabilities;
+  cJSON *initialization_options;
 } Config;
 
 Config *create_config(int argc, char *argv[]);
@@ -0,0 +1,19 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef GIT_INDEX_H_INCLUDED
+#define GIT_INDEX_H_INCLUDED
+
+// A regular file staged in the git index
+typedef struct {
+  char *path; // relative to the work tree
+  size_t size;
+} GitIndexEntry;
+
+// Reads the index of the work tree at `root_path` without running git, only
+// entries at stage 0 that are checked out as regular files are kept. Index
+// versions 2 to 4 are read. False if there is no index or it isn't valid.
+bool read_git_index(const char *root_path, GitIndexEntry **entries);
+void free_git_index(GitIndexEntry *entries);
+
+#endif
@@ -1,12 +1,46 @@
-#include "stdbool.h"
+#include "cJSON.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #ifndef IGNORE_H_INCLUDED
 #define IGNORE_H_INCLUDED
 
-static const char *IGNORE_FILES[] = {".gitignore"};
-static const char *IGNORE_DIRECTORIES[] = {".git"};
+// The compiled patterns of one source, a .gitignore or an exclude list
+typedef struct IgnoreRules IgnoreRules;
 
-bool is_ignored_file(char *file_path);
-bool is_ignored_dir(char *file_path);
+// A directory with a .gitignore, linked to the closest one above it
+typedef struct IgnoreLevel {
+  struct IgnoreLevel *parent;
+  IgnoreRules *rules;
+  size_t dir_length; // patterns with a slash match the path below this directory
+} IgnoreLevel;
+
+typedef struct {
+  size_t root_length;
+  IgnoreRules *excludes;     // `exclude` from initializationOptions, over every .gitignore
+  IgnoreRules *info_exclude; // .git/info/exclude, under every .gitignore
+  pthread_mutex_t lock;
+  IgnoreLevel **levels; // freed with the Ignore
+} Ignore;
+
+// `excludes` is an array of patterns in .gitignore syntax relative to the root
+Ignore *create_ignore(const char *root_path, const cJSON *excludes);
+void destroy_ignore(Ignore *ignore);
+
+// Reads the .gitignore of a directory about to be walked, if it has one.
+// Returns the level its entries are matched against.
+IgnoreLevel *enter_ignore_level(Ignore *ignore, IgnoreLevel *parent, int dir_fd,
+                                const char *dir_path);
+
+// Whether the entry `name` of `dir_path` is ignored. Sources are asked from
+// the most to the least specific, the last matching pattern of the first
+// source with a match decides, like git does.
+bool is_ignored(Ignore *ignore, IgnoreLevel *level, const char *dir_path, const char *name,
+                bool is_dir);
+
+// Whether a path relative to the root is excluded by initializationOptions,
+// for files listed without a walk
+bool is_excluded(Ignore *ignore, const char *path);
 
 #endif
@@ -0,0 +1,29 @@
+#include "parser.h"
+#include "server.h"
+#include "source.h"
+#include <stddef.h>
+
+#ifndef INDEXER_H_INCLUDED
+#define INDEXER_H_INCLUDED
+
+// A workspace file on its way into the index
+typedef struct {
+  char *path;
+  size_t size;
+  Source *source;  // NULL until the file is read
+  ConstHM *consts; // the file's own constants until they're merged
+} IndexFile;
+
+// Called on the calling thread once the files are listed and after every
+// batch merged into the index, the last call has `done == total`
+typedef void (*IndexProgress)(void *arg, size_t done, size_t total);
+
+// Indexes every Ruby file under `root_path` in three stages: the walk, or the
+// git index with --git-index, lists the files, then indexing threads read and
+// parse them, largest first, each into the file's own constant table. The
+// tables are merged into the index as files are done, so requests see a
+// growing partial index. At the end the locations of every constant are
+// sorted, the result doesn't depend on the scheduling.
+void index_workspace(Server *server, char *root_path, IndexProgress progress, void *arg);
+
+#endif
@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef JSON_SCAN_H_INCLUDED
+#define JSON_SCAN_H_INCLUDED
+
+// Raw bytes of a JSON value (strings include their quotes), pointing into
+// the message it was scanned from.
+typedef struct {
+  const char *start;
+  size_t length;
+} JsonSpan;
+
+// Position inside an object or array being walked member by member
+typedef struct {
+  const char *position;
+  const char *end;
+  bool first;
+} JsonCursor;
+
+// Forward-only scanning of JSON without building a tree. Values that aren't
+// needed are skipped, strings with memchr, so looking at a few fields of a
+// message costs a single pass over its bytes.
+bool json_skip_value(const char **position, const char *end);
+bool json_enter(JsonSpan value, JsonCursor *cursor);
+bool json_next_member(JsonCursor *cursor, JsonSpan *key, JsonSpan *value);
+bool json_next_element(JsonCursor *cursor, JsonSpan *value);
+bool json_get(JsonSpan object, const char *key, JsonSpan *value);
+bool json_key_equals(JsonSpan key, const char *str);
+bool json_is_string(JsonSpan value);
+char *json_string_dup(JsonSpan value);
+
+#endif
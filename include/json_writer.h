@@ -0,0 +1,24 @@
+#include <stddef.h>
+#include <string.h>
+
+#ifndef JSON_WRITER_H_INCLUDED
+#define JSON_WRITER_H_INCLUDED
+
+// Append-only buffer that JSON is printed into directly, without building a
+// cJSON tree first. The caller writes the separators, the writer only knows
+// how to print scalars.
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} JsonWriter;
+
+void json_writer_init(JsonWriter *writer, size_t capacity);
+void json_write_raw(JsonWriter *writer, const char *str, size_t length);
+void json_write_string(JsonWriter *writer, const char *str);
+void json_write_number(JsonWriter *writer, long number);
+char *json_writer_finish(JsonWriter *writer);
+
+#define json_write_literal(writer, literal) json_write_raw(writer, literal, sizeof(literal) - 1)
+
+#endif
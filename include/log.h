@@ -0,0 +1,54 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef LOG_H_INCLUDED
+#define LOG_H_INCLUDED
+
+typedef enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_TRACE } LogLevel;
+
+#define LOG_LEVEL LOG_INFO
+// longer messages are cut
+#define LOG_SLOT_SIZE 512
+// a power of two, messages logged while the ring is full are dropped
+#define LOG_RING_SLOTS 4096
+
+// Messages are formatted on the calling thread into a lock-free ring and
+// written by a background thread, so logging never waits for the disk or a
+// full pipe. Until start_logger they're written straight to stderr.
+bool parse_log_level(const char *name, LogLevel *level);
+void set_log_level(LogLevel level);
+void start_logger(const char *file_path);
+void stop_logger();
+void log_message(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+extern LogLevel log_level;
+
+#define LOG_AT(level, ...)                                                                         \
+  do {                                                                                             \
+    if ((int)(level) <= (int)__atomic_load_n(&log_level, __ATOMIC_RELAXED))                        \
+      log_message(level, __VA_ARGS__);                                                             \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+
+// Per-message and per-file logs. Release builds (-DNDEBUG) still type check
+// them but never evaluate the arguments, the calls are compiled out.
+#ifdef NDEBUG
+#define log_debug(...)                                                                             \
+  do {                                                                                             \
+    if (0)                                                                                         \
+      log_message(LOG_DEBUG, __VA_ARGS__);                                                         \
+  } while (0)
+#define log_trace(...)                                                                             \
+  do {                                                                                             \
+    if (0)                                                                                         \
+      log_message(LOG_TRACE, __VA_ARGS__);                                                         \
+  } while (0)
+#else
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LOG_TRACE, __VA_ARGS__)
+#endif
+
+#endif
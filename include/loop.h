@@ -0,0 +1,62 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#ifndef LOOP_H_INCLUDED
+#define LOOP_H_INCLUDED
+
+#define MAX_EVENTS 64
+
+typedef enum { WATCH_LISTENER, WATCH_CLIENT, WATCH_TIMER, WATCH_WAKER } WatchKind;
+
+// Every descriptor registered in the loop is described by a Watch stored in
+// `epoll_data.ptr`, so a wakeup leads straight to its owner without lookups.
+typedef struct {
+  WatchKind kind;
+  int fd;
+  void *owner;
+} Watch;
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer *timer, void *arg);
+
+struct Timer {
+  Watch watch;
+  TimerCallback callback;
+  void *arg;
+};
+
+// Lets other threads wake the loop up, the callback runs on the loop's thread
+typedef struct Waker Waker;
+typedef void (*WakerCallback)(Waker *waker, void *arg);
+
+struct Waker {
+  Watch watch;
+  WakerCallback callback;
+  void *arg;
+};
+
+typedef struct {
+  int epoll_fd;
+  struct epoll_event events[MAX_EVENTS];
+} Loop;
+
+Loop *create_loop();
+bool loop_add(Loop *loop, Watch *watch, uint32_t events);
+void loop_modify(Loop *loop, Watch *watch, uint32_t events);
+void loop_remove(Loop *loop, Watch *watch);
+int loop_wait(Loop *loop, int timeout_ms);
+void destroy_loop(Loop *loop);
+
+Timer *create_timer(Loop *loop, TimerCallback callback, void *arg);
+void timer_start(Timer *timer, uint64_t timeout_ms, uint64_t interval_ms);
+void timer_stop(Timer *timer);
+void timer_expired(Timer *timer);
+void destroy_timer(Loop *loop, Timer *timer);
+
+Waker *create_waker(Loop *loop, WakerCallback callback, void *arg);
+void wake(Waker *waker);
+void waker_woken(Waker *waker);
+void destroy_waker(Loop *loop, Waker *waker);
+
+#endif
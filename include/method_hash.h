@@ -0,0 +1,17 @@
+// Generated by scripts/gen_method_hash.rb from src/methods.def, don't edit.
+
+#ifndef METHOD_HASH_H_INCLUDED
+#define METHOD_HASH_H_INCLUDED
+
+#define METHOD_HASH_SEED 13u
+#define METHOD_TABLE_SIZE 32
+
+// index into the methods.def entries for every hash slot, -1 if it's empty
+static const signed char METHOD_SLOTS[METHOD_TABLE_SIZE] = {
+     4, -1, -1, -1, -1,  6, -1,  3,
+     1, -1, -1, -1,  8, -1, -1, 10,
+    -1, -1, -1,  0,  9, -1, -1,  5,
+    -1, -1,  7, -1, -1, -1,  2, -1,
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "server.h"
+#include "transport.h"
+#include <stddef.h>
+
+#ifndef METHODS_H_INCLUDED
+#define METHODS_H_INCLUDED
+
+typedef void (*MethodHandler)(Server *server, Client *client, Request *request);
+
+typedef enum { METHOD_REQUEST, METHOD_NOTIFICATION } MethodKind;
+
+// Messages of a higher priority (lower value) run first when there is a backlog.
+// Workspace indexing runs outside the pool at PRIORITY_BACKGROUND, see
+// scheduler_yield.
+typedef enum { PRIORITY_INTERACTIVE, PRIORITY_DOCUMENT_SYNC, PRIORITY_BACKGROUND } MethodPriority;
+#define PRIORITY_CLASSES 3
+
+// Where the handler runs when there is a worker pool. Methods that change the
+// server status are barriers: ON_IO_THREAD_DRAINED ones run inline once the
+// workers are idle, the client's messages after an ON_WORKER_BLOCKING one wait
+// until it's done.
+typedef enum { ON_WORKER, ON_WORKER_BLOCKING, ON_IO_THREAD, ON_IO_THREAD_DRAINED } MethodThread;
+
+#define IN_STATE(status) (1u << (status))
+#define ANY_STATE (IN_STATE(UNINITIALIZED) | IN_STATE(INITIALIZED) | IN_STATE(SHUTDOWN))
+
+typedef struct {
+  const char *name;
+  MethodHandler handler;
+  MethodKind kind;
+  unsigned allowed_states; // IN_STATE bits of the server statuses
+  MethodPriority priority;
+  MethodThread thread;
+} Method;
+
+const Method *lookup_method(const char *name);
+// Methods are numbered by their position in methods.def
+size_t method_count();
+size_t method_index(const Method *method);
+const Method *method_at(size_t index);
+void call_method(const Method *method, Server *server, Client *client, Request *request);
+
+#endif
@@ -12,6 +12,7 @@ typedef struct {
 
 typedef struct {
   char *file_path;
+  const char *uri; // shared with the source, already quoted for JSON
   Position *start;
   Position *end;
 } Location;
@@ -41,7 +42,14 @@ typedef struct {
   size_t character;
 } VisitArgs;
 
+// parse is the three steps below. The first two only touch the source, so
+// files can be parsed in parallel and merged into the index one by one.
 void parse(Source *source, ParsedInfo *parsed_info);
+bool parse_source(Source *source);
+ConstHM *extract_consts(Source *source);
+void merge_consts(ParsedInfo *parsed_info, Source *source, ConstHM *consts);
+// Constants of one file, parse merges them into the workspace index
+ConstHM *build_const_map(Source *source, pm_parser_t *parser, pm_node_t *node, ConstHM *consts);
 void traverse_ast(pm_node_t *node, pm_parser_t *parser,
                   void (*visit)(pm_node_t *, pm_parser_t *, void *), void *arg);
 void find_node_by_location(pm_node_t *node, pm_parser_t *parser, void *arg);
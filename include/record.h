@@ -0,0 +1,18 @@
+#include <stddef.h>
+
+#ifndef RECORD_H_INCLUDED
+#define RECORD_H_INCLUDED
+
+#define RECORDING_MAGIC "FRLS-RECORDING 1\n"
+
+// Every inbound message is appended to the recording as a line
+//
+//     <microseconds since start> <client id> <body length>\n
+//
+// followed by the body and a newline. bench/replay.rb feeds recordings back
+// into a fresh server.
+void start_recording(const char *file_path);
+void stop_recording();
+void record_frame(unsigned client_id, const char *body, size_t length);
+
+#endif
@@ -1,15 +1,23 @@
+#include "arena.h"
 #include "config.h"
+#include "loop.h"
 #include "parser.h"
 #include "source.h"
 #include "transport.h"
+#include <pthread.h>
 
 #ifndef SERVER_H_INCLUDED
 #define SERVER_H_INCLUDED
 
 #define MAX_CONNECTIONS 8
+#define IDLE_INTERVAL_MS 5000
+// messages parsed ahead from one client before they're dispatched
+#define MAX_BATCH_SIZE 64
 
 typedef enum { UNINITIALIZED, INITIALIZED, SHUTDOWN } SeverStatus;
 
+typedef struct WorkerPool WorkerPool;
+
 typedef struct {
   Config *config;
   ParsedInfo *parsed_info;
@@ -17,8 +25,17 @@ typedef struct {
   SeverStatus status;
   SOCKET server_socket;
   Client *clients;
-  fd_set *master_set;
-  fd_set *working_set;
+  bool blocking_input;
+  // sources and parsed_info are read by requests and rebuilt by parsing on
+  // the workers
+  pthread_rwlock_t index_lock;
+  WorkerPool *workers; // NULL if handlers run on the I/O thread
+  Loop *loop;
+  Waker *waker; // workers wake the loop up when a blocking job is done
+  Arena *arena; // request/response cycle of the I/O thread
+  Watch listener;
+  Timer *idle_timer;
+  Timer *reparse_timer; // debounces reparsing of changed documents
 } Server;
 
 void sync_source(Server *server, char *file_path, char *text);
@@ -26,7 +43,11 @@ Server *create_server(Config *config);
 void uninitialized_error(Client *client, Request *req);
 void invalid_request(Client *client, Request *req);
 void invalid_params(Client *client, Request *req);
+void method_not_found(Client *client, Request *req);
+void request_cancelled(Client *client, Request *req);
 void send_error(Client *client, Request *req, char *error_msg, int err_code);
+bool read_client(Server *server, Client *client);
+void resume_clients(Waker *waker, void *arg);
 void start_server(Server *server);
 void destroy_server(Server *server);
 void accept_message(Server *server);
@@ -1,4 +1,5 @@
 #include "prism.h"
+#include <stdbool.h>
 
 #ifndef SOURCE_H_INCLUDED
 #define SOURCE_H_INCLUDED
@@ -7,12 +8,15 @@ typedef enum { OPENED, CLOSED } OpenStatus;
 
 typedef struct {
   char *file_path;
+  char *uri; // `file://` URI as a JSON string, printed into every location
   char *content;
   pm_node_t *root;
   pm_parser_t *parser;
   OpenStatus open_status;
+  bool dirty; // the text has changed since it was parsed
 } Source;
 
+Source *create_source(char *file_path, char *content);
 void print_sources(Source **sources);
 
 #endif
@@ -0,0 +1,58 @@
+#include "cJSON.h"
+#include "methods.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+// Log-linear buckets like HDR histograms: every power of two is split into
+// 16 sub-buckets, so a recorded latency is off by at most 1/16. Nanoseconds
+// up to 2^36 (about a minute), longer ones land in the last bucket.
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Updated with atomic adds, the I/O thread and the workers record concurrently
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+} Histogram;
+
+// Where a message's time goes. The handler phase includes serialization, which
+// is also recorded on its own. Send is from queueing the response until its
+// last byte is written.
+typedef enum {
+  PHASE_FRAME,
+  PHASE_PARSE,
+  PHASE_HANDLER,
+  PHASE_SERIALIZE,
+  PHASE_SEND,
+  PHASE_COUNT
+} StatsPhase;
+
+typedef enum {
+  COUNTER_MESSAGES,
+  COUNTER_BYTES_IN,
+  COUNTER_BYTES_OUT,
+  COUNTER_REPARSES,
+  COUNTER_COUNT
+} StatsCounter;
+
+void init_stats();
+uint64_t stats_now();
+void record_phase(const Method *method, StatsPhase phase, uint64_t nanoseconds);
+void count_stat(StatsCounter counter, uint64_t amount);
+
+// The method being handled on this thread, responses and serialization are
+// recorded under it. Returns the previous one, handlers can run nested.
+const Method *stats_enter_method(const Method *method);
+const Method *stats_current_method();
+
+cJSON *stats_to_json(size_t sources, size_t constants);
+void dump_stats(const char *file_path, size_t sources, size_t constants);
+
+#endif
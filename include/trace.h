@@ -0,0 +1,24 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+// spans a thread keeps before it writes them out
+#define TRACE_BUFFER_SPANS 4096
+// longer span details, e.g. file paths, are cut
+#define TRACE_DETAIL_SIZE 128
+
+// Spans in the Chrome trace-event format, for chrome://tracing or Perfetto.
+// Every thread collects its spans in its own buffer and only takes the file
+// lock when the buffer is full, the rest is written at exit.
+void start_tracing(const char *file_path);
+void stop_tracing();
+
+// 0 when tracing is off, trace_end ignores those spans
+uint64_t trace_begin();
+
+// `name` has to be a literal, `detail` is copied and may be NULL
+void trace_end(const char *name, const char *detail, uint64_t started);
+
+#endif
@@ -1,5 +1,10 @@
 #include "./cJSON.h"
+#include "json_scan.h"
+#include "loop.h"
 #include "stdlib.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 #ifndef TRANSPORT_H_INCLUDED
@@ -8,18 +13,55 @@
 #define SOCKET int
 #define DEFAULT_CHARSET "utf-8"
 #define MESSAGE_BUFFER_SIZE 64000
+// headers are tiny, anything bigger is garbage on the wire
+#define MAX_HEADERS_SIZE 8192
+#define MAX_CONTENT_LENGTH (256 * 1024 * 1024)
+#define RESPONSE_HEADER_SIZE 96
+// iovecs handed to a single writev call
+#define MAX_WRITE_BATCH 64
 
 typedef struct {
   char *content_type;
   char *charset;
-  size_t *content_length;
+  size_t content_length;
+  bool has_content_length;
 } Headers;
 
+typedef enum { FRAME_INCOMPLETE, FRAME_READY, FRAME_INVALID } FrameStatus;
+
+// One complete message. `body` points into the framer buffer and stays valid
+// until the next `framer_reserve` call.
+typedef struct {
+  Headers *headers;
+  char *body;
+  size_t body_length;
+} Frame;
+
+// Accumulates raw bytes of a connection and cuts them into `Content-Length`
+// framed messages. Headers of the pending message are parsed only once.
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+  size_t start;   // beginning of the pending message
+  size_t scanned; // how far we've looked for the end of headers
+  Headers *headers;
+  size_t body_start;
+} Framer;
+
+// Only the envelope is scanned up front. `raw_params` points into the framer
+// buffer, or into `message` once the request is detached from it. `params`
+// stays NULL until request_params parses it into `body`.
 typedef struct {
   int id;
+  bool has_id;
   Headers *headers;
   char *method;
+  char *message;
+  JsonSpan raw_params;
   cJSON *params;
+  cJSON *body;
+  uint64_t parse_time; // nanoseconds scanning the envelope and parsing params
 } Request;
 
 typedef struct {
@@ -34,13 +76,41 @@ typedef struct {
   Error *error;
 } Response;
 
+// A response waiting to be written. The body is owned by the frame and is
+// written straight from where the handler has printed it.
+typedef struct OutFrame OutFrame;
+struct OutFrame {
+  char header[RESPONSE_HEADER_SIZE];
+  size_t header_length;
+  char *body;
+  size_t body_length;
+  size_t written; // header and body bytes already sent
+  uint64_t queued_at;
+  const void *method; // the Method that responded, for stats
+  OutFrame *next;
+};
+
 typedef struct Client Client;
 struct Client {
+  unsigned id; // numbered from 1 in the order clients connect, for recordings
   socklen_t address_length;
   struct sockaddr_storage address;
+  // input descriptor, stdin in stdio mode
   SOCKET socket;
-  char request[MESSAGE_BUFFER_SIZE];
-  int received;
+  int output;
+  Watch watch;
+  Watch output_watch; // used only when output isn't the socket, e.g. stdout
+  Framer *framer;
+  // workers queue responses too, the output fields are guarded by the lock
+  pthread_mutex_t output_lock;
+  OutFrame *output_head;
+  OutFrame *output_tail;
+  size_t output_bytes; // queued and not yet written
+  bool closed;         // dropped, responses of in-flight jobs are discarded
+  bool paused;         // not read from until the output drains
+  bool waiting;        // messages wait for a blocking job, cleared by the worker
+  int refs;            // the server's reference and one per in-flight job
+  Client *prev;
   Client *next;
 };
 
@@ -136,11 +206,28 @@ enum ErrorCodes {
   lspReservedErrorRangeEnd = -32800
 };
 
-Headers *create_headers(char *headers_str);
-Request *create_request(char *headers_str);
+Headers *create_headers(char *headers_str, size_t length);
+Request *create_request(Headers *headers, char *body, size_t body_length);
+cJSON *request_params(Request *request);
+Request *detach_request(Request *request);
 Response *create_response();
 
-void send_response(int socket, int status, char *body);
+Framer *create_framer();
+char *framer_reserve(Framer *framer, size_t size);
+void framer_commit(Framer *framer, size_t size);
+FrameStatus framer_next(Framer *framer, Frame *frame);
+void framer_shrink(Framer *framer);
+void destroy_framer(Framer *framer);
+
+Client *create_client();
+void retain_client(Client *client);
+void release_client(Client *client);
+void close_client(Client *client);
+size_t pending_output(Client *client);
+void send_response(Client *client, char *body);
+void send_json(Client *client, cJSON *json);
+bool flush_output(Client *client);
+void discard_output(Client *client);
 void destroy_headers(Headers *headers);
 void destroy_request(Request *request);
 void destroy_response(Response *response);
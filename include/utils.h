@@ -1,18 +1,20 @@
+#include "log.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef UTILS_H_INCLUDED
 #define UTILS_H_INCLUDED
 
+#define ARRAY_LENGTH(arr) (sizeof(arr) / sizeof((arr)[0]))
+
 char *trim(char *str);
 void fail(char *msg);
-void log_info(char *msg, ...);
-void log_error(char *msg, ...);
 
 bool is_dir(char *file_path);
 bool is_file(char *file_path);
 bool is_ends_with(char *left, const char *right);
 bool is_starts_with(char *left, char *right);
-bool is_includes(const char **arr, char *str);
+bool is_includes(const char **arr, size_t length, char *str);
 char *concat_strings(const char *str1, const char *str2);
 char *file_ext(char *file_path);
 char *file_name(char *file_path);
@@ -0,0 +1,30 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef WALKER_H_INCLUDED
+#define WALKER_H_INCLUDED
+
+typedef struct {
+  char *path; // the walked root joined with the path below it
+  size_t size;
+} WalkFile;
+
+typedef struct {
+  // Called with every directory before its entries are read, returns the state
+  // they're judged with. Subdirectories get it as `parent`. Optional.
+  void *(*open_dir)(void *arg, void *parent, int fd, const char *dir_path);
+  // Entries are judged by name before anything is stat'ed or allocated, a
+  // rejected directory isn't opened
+  bool (*accept)(void *arg, void *state, const char *dir_path, const char *name, bool is_dir);
+  void *arg;
+} WalkFilter;
+
+// Lists the files under `root_path` the filter accepts, in no particular order.
+// Directories are read with getdents64 into a large buffer and files stat'ed
+// relative to their directory, a path is only built for accepted files and
+// entered directories. Entries without a d_type and symlinks are resolved with
+// statx, a directory reached twice, through a link cycle or otherwise, is read
+// once. `thread_count` threads share a stack of directories to read.
+WalkFile *walk_tree(const char *root_path, size_t thread_count, const WalkFilter *filter);
+
+#endif
@@ -0,0 +1,74 @@
+#include "arena.h"
+#include "cancel.h"
+#include "methods.h"
+#include "server.h"
+#include "transport.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef WORKERS_H_INCLUDED
+#define WORKERS_H_INCLUDED
+
+// Work that isn't a response to a message, e.g. a debounced reparse
+typedef void (*Task)(Server *server);
+
+typedef struct Job Job;
+struct Job {
+  Client *client; // retained until the job is done
+  Request *request;
+  const Method *method;
+  Task task; // set instead of the above for internal work
+  PendingRequest *pending; // NULL for notifications
+  MethodPriority priority;
+  Job *next;
+};
+
+// Jobs with the same key, e.g. messages about one document, run one at a time
+// in the order they were submitted
+typedef struct Strand Strand;
+struct Strand {
+  uint64_t key;
+  Job *head;
+  Job *tail;
+  bool running;
+  Strand *next; // in the ready queue of its head job's priority
+};
+
+typedef struct {
+  uint64_t key;
+  Strand *value;
+} StrandHM;
+
+typedef struct {
+  pthread_t thread;
+  WorkerPool *pool;
+  Arena *arena;
+} Worker;
+
+// Idle workers take the next job of the highest priority that's ready
+struct WorkerPool {
+  Server *server;
+  Worker *workers;
+  size_t count;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t idle;
+  pthread_cond_t foreground_done; // no job above PRIORITY_BACKGROUND is left
+  Strand *queue_heads[PRIORITY_CLASSES];
+  Strand *queue_tails[PRIORITY_CLASSES];
+  StrandHM *strands;
+  size_t running[PRIORITY_CLASSES]; // jobs being run, by priority
+  size_t unfinished; // submitted and not done yet
+  bool stopping;
+};
+
+WorkerPool *create_worker_pool(Server *server, size_t count);
+void submit_job(WorkerPool *pool, Client *client, Request *request, const Method *method);
+void submit_task(WorkerPool *pool, Task task, MethodPriority priority);
+void scheduler_yield(WorkerPool *pool);
+void drain_worker_pool(WorkerPool *pool);
+void destroy_worker_pool(WorkerPool *pool);
+
+#endif
@@ -0,0 +1,66 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+# Generates the perfect hash table used by lookup_method from the method names
+# in src/methods.def. It searches for a seed under which FNV-1a puts every name
+# in its own slot, so a lookup is one hash and one string compare.
+#
+#   ruby scripts/gen_method_hash.rb src/methods.def include/method_hash.h
+
+FNV_OFFSET = 2_166_136_261
+FNV_PRIME = 16_777_619
+MASK = 0xFFFFFFFF
+MAX_SEED = 1_000_000
+
+# must match method_hash in src/methods.c. The low bits of FNV-1a only depend
+# on the low bits of the input, so the high half is folded into them.
+def method_hash(name, seed)
+  hash = name.each_byte.reduce(FNV_OFFSET ^ seed) { |h, byte| ((h ^ byte) * FNV_PRIME) & MASK }
+  hash ^ (hash >> 16)
+end
+
+def find_slots(names, size)
+  (0...MAX_SEED).each do |seed|
+    slots = Array.new(size, -1)
+    placed = names.each_with_index.all? do |name, index|
+      slot = method_hash(name, seed) & (size - 1)
+      next false unless slots[slot] == -1
+
+      slots[slot] = index
+    end
+    return [seed, slots] if placed
+  end
+  nil
+end
+
+def_path, header_path = ARGV
+abort "usage: #{$PROGRAM_NAME} methods.def method_hash.h" unless def_path && header_path
+
+names = File.read(def_path).scan(/^METHOD\("([^"]+)"/).flatten
+abort "No methods found in #{def_path}" if names.empty?
+abort 'Duplicate method names' if names.uniq.size != names.size
+
+# twice the methods rounded up to a power of two keeps the seed search short
+size = 1
+size <<= 1 while size < names.size * 2
+seed, slots = find_slots(names, size)
+abort 'No perfect hash seed found' unless seed
+
+rows = slots.each_slice(8).map { |row| "    #{row.map { |slot| slot.to_s.rjust(2) }.join(', ')}," }
+
+File.write(header_path, <<~HEADER)
+  // Generated by scripts/gen_method_hash.rb from #{def_path}, don't edit.
+
+  #ifndef METHOD_HASH_H_INCLUDED
+  #define METHOD_HASH_H_INCLUDED
+
+  #define METHOD_HASH_SEED #{seed}u
+  #define METHOD_TABLE_SIZE #{size}
+
+  // index into the methods.def entries for every hash slot, -1 if it's empty
+  static const signed char METHOD_SLOTS[METHOD_TABLE_SIZE] = {
+  #{rows.join("\n")}
+  };
+
+  #endif
+HEADER
@@ -0,0 +1,103 @@
+#include "arena.h"
+#include "cJSON.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+static __thread Arena *current_arena = NULL;
+
+// Makes the reserved pages up to `size` usable
+static void commit(Arena *arena, size_t size) {
+  if (mprotect(arena->base + arena->committed, size - arena->committed,
+               PROT_READ | PROT_WRITE) != 0) {
+    fail("Out of memory");
+  }
+  arena->committed = size;
+}
+
+Arena *create_arena() {
+  Arena *arena = malloc(sizeof(Arena));
+  if (!arena) {
+    fail("Out of memory");
+  }
+  arena->base = mmap(NULL, ARENA_RESERVE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena->base == MAP_FAILED) {
+    fail("Out of memory");
+  }
+  arena->used = 0;
+  arena->committed = 0;
+  commit(arena, ARENA_BLOCK_SIZE);
+  return arena;
+}
+
+// Big strings like a whole document take as many blocks as they need, right
+// after the previous allocation
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (size > ARENA_RESERVE_SIZE - arena->used) {
+    fail("Out of memory");
+  }
+  if (arena->used + size > arena->committed) {
+    // doubled, a big cycle takes a few mprotect calls
+    size_t needed = (arena->used + size + ARENA_BLOCK_SIZE - 1) & ~(size_t)(ARENA_BLOCK_SIZE - 1);
+    size_t committed = arena->committed * 2;
+    if (committed < needed) {
+      committed = needed;
+    }
+    if (committed > ARENA_RESERVE_SIZE) {
+      committed = ARENA_RESERVE_SIZE;
+    }
+    commit(arena, committed);
+  }
+
+  void *ptr = arena->base + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+bool arena_owns(Arena *arena, void *ptr) {
+  return (char *)ptr >= arena->base && (char *)ptr < arena->base + arena->used;
+}
+
+// Keeps one block committed for the next cycle, the pages past it go back to
+// the system
+void arena_reset(Arena *arena) {
+  if (arena->committed > ARENA_BLOCK_SIZE) {
+    char *start = arena->base + ARENA_BLOCK_SIZE;
+    size_t length = arena->committed - ARENA_BLOCK_SIZE;
+    madvise(start, length, MADV_DONTNEED);
+    mprotect(start, length, PROT_NONE);
+    arena->committed = ARENA_BLOCK_SIZE;
+  }
+  arena->used = 0;
+}
+
+void destroy_arena(Arena *arena) {
+  munmap(arena->base, ARENA_RESERVE_SIZE);
+  free(arena);
+}
+
+static void *arena_malloc(size_t size) {
+  return current_arena ? arena_alloc(current_arena, size) : malloc(size);
+}
+
+static void arena_free(void *ptr) {
+  if (current_arena && arena_owns(current_arena, ptr)) {
+    return;
+  }
+  free(ptr);
+}
+
+void install_arena_hooks() {
+  cJSON_Hooks hooks = {.malloc_fn = arena_malloc, .free_fn = arena_free};
+  cJSON_InitHooks(&hooks);
+}
+
+// Returns the previously entered arena so it can be restored
+Arena *arena_enter(Arena *arena) {
+  Arena *previous = current_arena;
+  current_arena = arena;
+  return previous;
+}
@@ -0,0 +1,72 @@
+#include "cancel.h"
+#include "stb_ds.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// long keeps the key free of padding, stb_ds hashes its bytes
+typedef struct {
+  const Client *client;
+  long id;
+} PendingKey;
+
+typedef struct {
+  PendingKey key;
+  PendingRequest *value;
+} PendingHM;
+
+static PendingHM *pending_requests = NULL;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread PendingRequest *current_request = NULL;
+
+static PendingKey pending_key(const Client *client, int id) {
+  PendingKey key = {.client = client, .id = id};
+  return key;
+}
+
+PendingRequest *register_request(Client *client, int id) {
+  PendingRequest *pending = malloc(sizeof(PendingRequest));
+  if (!pending) {
+    fail("Out of memory");
+  }
+  pending->client = client;
+  pending->id = id;
+  pending->cancelled = false;
+
+  pthread_mutex_lock(&pending_lock);
+  hmput(pending_requests, pending_key(client, id), pending);
+  pthread_mutex_unlock(&pending_lock);
+  return pending;
+}
+
+void unregister_request(PendingRequest *pending) {
+  pthread_mutex_lock(&pending_lock);
+  // a client may reuse the id of a request it has given up on
+  if (hmget(pending_requests, pending_key(pending->client, pending->id)) == pending) {
+    hmdel(pending_requests, pending_key(pending->client, pending->id));
+  }
+  pthread_mutex_unlock(&pending_lock);
+  free(pending);
+}
+
+// Returns false if the request is unknown, e.g. it's already been answered
+bool cancel_request(Client *client, int id) {
+  pthread_mutex_lock(&pending_lock);
+  PendingRequest *pending = hmget(pending_requests, pending_key(client, id));
+  if (pending) {
+    __atomic_store_n(&pending->cancelled, true, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&pending_lock);
+  return pending != NULL;
+}
+
+// Returns the request that was current before, jobs can run nested
+PendingRequest *enter_request(PendingRequest *pending) {
+  PendingRequest *previous = current_request;
+  current_request = pending;
+  return previous;
+}
+
+bool is_request_cancelled() {
+  return current_request && __atomic_load_n(&current_request->cancelled, __ATOMIC_RELAXED);
+}
@@ -1,12 +1,16 @@
 #include "commands.h"
-#include "ignore.h"
+#include "arena.h"
+#include "cancel.h"
+#include "indexer.h"
+#include "json_writer.h"
 #include "parser.h"
 #include "source.h"
+#include "stats.h"
 #include "stb_ds.h"
+#include "trace.h"
 #include "transport.h"
 #include "utils.h"
-#include <dirent.h>
-#include <limits.h>
+#include "workers.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +18,13 @@
 static const char *SUPPORTED_FILE_EXTENSIONS[] = {".rb"};
 static const char *SUPPORTED_LANGUAGE_IDS[] = {"ruby"};
 
+#define INDEXING_PROGRESS_TOKEN "frls/indexing"
+// MessageType of window/showMessage
+#define MESSAGE_TYPE_INFO 3
+
+// The source takes ownership of `content`
 Source *add_source(Server *server, char *file_path, char *content) {
-  Source *source = malloc(sizeof(Source));
-  source->file_path = strndup(file_path, strlen(file_path));
-  source->content = strndup(content, strlen(content));
+  Source *source = create_source(file_path, content);
   arrput(server->sources, source);
   return source;
 }
@@ -35,31 +42,33 @@ Source *get_source(Server *server, char *file_path) {
 }
 
 void sync_source(Server *server, char *file_path, char *content) {
-  log_info("Syncing file %s...", file_path);
+  log_debug("Syncing file %s...", file_path);
 
   Source *source = get_source(server, file_path);
   if (source) {
     free(source->content);
-    source->content = strndup(content, strlen(content));
-    log_info("Source updated");
+    source->content = content;
+    log_debug("Source updated");
   } else {
     source = add_source(server, file_path, content);
     source->open_status = OPENED;
-    log_info("New source added");
+    log_debug("New source added");
   }
 }
 
+// Takes the index lock for just this file, requests get in between files
 void process_file(Server *server, char *file_path) {
-  if (is_ignored_file(file_path))
-    return;
-
-  log_info("Processing file `%s`", file_path);
-  if (is_includes(SUPPORTED_FILE_EXTENSIONS, file_ext(file_path))) {
+  log_debug("Processing file `%s`", file_path);
+  if (is_includes(SUPPORTED_FILE_EXTENSIONS, ARRAY_LENGTH(SUPPORTED_FILE_EXTENSIONS),
+                  file_ext(file_path))) {
+    uint64_t started = trace_begin();
     char *content = readall(file_path);
+    trace_end("readall", file_path, started);
+    pthread_rwlock_wrlock(&server->index_lock);
     Source *source = add_source(server, file_path, content);
-    free(content);
     source->open_status = CLOSED;
     parse(source, server->parsed_info);
+    pthread_rwlock_unlock(&server->index_lock);
   } else {
     log_error("Unsupported file type: %s. Server supports only files "
               "with extensions: `%s`",
@@ -68,50 +77,208 @@ void process_file(Server *server, char *file_path) {
 }
 
 void process_content(Server *server, char *file_path, char *content) {
-  log_info("Processing file `%s`", file_path);
-  Source *source = get_source(server, file_path);
+  log_debug("Processing file `%s`", file_path);
   sync_source(server, file_path, content);
+  Source *source = get_source(server, file_path);
   parse(source, server->parsed_info);
+  count_stat(COUNTER_REPARSES, 1);
+  source->dirty = false;
 }
 
-void process_file_tree(Server *server, char *root_path) {
-  DIR *opened_dir;
-  struct dirent *dir;
-  opened_dir = opendir(root_path);
+// Runs when the documents have stopped changing for the debounce interval, a
+// burst of changes costs a single parse. Called with the index unlocked.
+void reparse_dirty_sources(Server *server) {
+  pthread_rwlock_wrlock(&server->index_lock);
+  for (size_t i = 0; i < arrlen(server->sources); ++i) {
+    Source *source = server->sources[i];
+    if (source->dirty) {
+      log_debug("Reparsing `%s`", source->file_path);
+      parse(source, server->parsed_info);
+      count_stat(COUNTER_REPARSES, 1);
+      source->dirty = false;
+    }
+  }
+  pthread_rwlock_unlock(&server->index_lock);
+}
 
-  if (opened_dir) {
-    while ((dir = readdir(opened_dir)) != NULL) {
-      char file_path[PATH_MAX + 1];
-      sprintf(file_path, "%s/%s", root_path, dir->d_name);
+// Requests reading a document see its latest text even if the debounce timer
+// hasn't fired yet
+static void flush_source(Server *server, char *file_path) {
+  pthread_rwlock_rdlock(&server->index_lock);
+  Source *source = get_source(server, file_path);
+  bool dirty = source && source->dirty;
+  pthread_rwlock_unlock(&server->index_lock);
+  if (!dirty) {
+    return;
+  }
 
-      if (dir->d_type == DT_DIR) {
-        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0 ||
-            is_ignored_dir(file_path)) {
-          continue;
-        }
-        process_file_tree(server, file_path);
-      }
+  pthread_rwlock_wrlock(&server->index_lock);
+  // sources are never removed, only the flag may have changed meanwhile
+  if (source->dirty) {
+    log_debug("Reparsing `%s` before reading it", file_path);
+    parse(source, server->parsed_info);
+    count_stat(COUNTER_REPARSES, 1);
+    source->dirty = false;
+  }
+  pthread_rwlock_unlock(&server->index_lock);
+}
 
-      if (dir->d_type == DT_REG) {
-        process_file(server, file_path);
-      }
+typedef struct {
+  Server *server;
+  Client *client; // retained until indexing is done
+  char *root_path;
+  bool report; // the client takes window/workDoneProgress
+  int percentage;
+} Indexing;
+
+static void send_progress(Client *client, const char *kind, const char *message, int percentage) {
+  cJSON *notification = cJSON_CreateObject();
+  cJSON_AddStringToObject(notification, "jsonrpc", "2.0");
+  cJSON_AddStringToObject(notification, "method", "$/progress");
+  cJSON *params = cJSON_AddObjectToObject(notification, "params");
+  cJSON_AddStringToObject(params, "token", INDEXING_PROGRESS_TOKEN);
+  cJSON *value = cJSON_AddObjectToObject(params, "value");
+  cJSON_AddStringToObject(value, "kind", kind);
+  if (strcmp(kind, "begin") == 0) {
+    cJSON_AddStringToObject(value, "title", "Indexing");
+    cJSON_AddBoolToObject(value, "cancellable", false);
+  }
+  cJSON_AddStringToObject(value, "message", message);
+  if (percentage >= 0) {
+    cJSON_AddNumberToObject(value, "percentage", percentage);
+  }
+  send_json(client, notification);
+  cJSON_Delete(notification);
+  flush_output(client);
+}
+
+// Clients without window/workDoneProgress are only told when indexing starts
+// and ends
+static void show_message(Client *client, const char *message) {
+  cJSON *notification = cJSON_CreateObject();
+  cJSON_AddStringToObject(notification, "jsonrpc", "2.0");
+  cJSON_AddStringToObject(notification, "method", "window/showMessage");
+  cJSON *params = cJSON_AddObjectToObject(notification, "params");
+  cJSON_AddNumberToObject(params, "type", MESSAGE_TYPE_INFO);
+  cJSON_AddStringToObject(params, "message", message);
+  send_json(client, notification);
+  cJSON_Delete(notification);
+  flush_output(client);
+}
+
+// Reports whole percents only, a big workspace would send thousands
+static void report_indexing(void *arg, size_t done, size_t total) {
+  Indexing *indexing = arg;
+  if (!indexing->report) {
+    if (done == 0) {
+      char message[96];
+      snprintf(message, sizeof(message),
+               "Indexing %zu files, results may be incomplete until it's done", total);
+      show_message(indexing->client, message);
     }
-    closedir(opened_dir);
+    return;
+  }
+  int percentage = total > 0 ? done * 100 / total : 100;
+  char message[96];
+  if (done == 0) {
+    snprintf(message, sizeof(message), "%zu files, results may be incomplete until it's done",
+             total);
+    send_progress(indexing->client, "begin", message, 0);
+  } else if (percentage > indexing->percentage && done < total) {
+    snprintf(message, sizeof(message), "%zu/%zu files", done, total);
+    send_progress(indexing->client, "report", message, percentage);
+  }
+  indexing->percentage = percentage;
+}
+
+static void *run_indexing(void *arg) {
+  Indexing *indexing = arg;
+  uint64_t started = trace_begin();
+  index_workspace(indexing->server, indexing->root_path, report_indexing, indexing);
+  trace_end("index_workspace", indexing->root_path, started);
+
+  pthread_rwlock_rdlock(&indexing->server->index_lock);
+  size_t sources = arrlen(indexing->server->sources);
+  pthread_rwlock_unlock(&indexing->server->index_lock);
+  log_info("Workspace indexed, %zu sources", sources);
+  if (indexing->report) {
+    char message[64];
+    snprintf(message, sizeof(message), "%zu sources indexed", sources);
+    send_progress(indexing->client, "end", message, -1);
   } else {
-    log_error("Error while reading `%s` because of error: '%s'", root_path, strerror(errno));
+    char message[64];
+    snprintf(message, sizeof(message), "Indexing done, %zu sources indexed", sources);
+    show_message(indexing->client, message);
   }
+
+  release_client(indexing->client);
+  free(indexing->root_path);
+  free(indexing);
+  return NULL;
+}
+
+// initialize answers right away, requests see the index as it grows. Clients
+// that take window/workDoneProgress are sent the percentage of files done,
+// the others a message when it starts and ends.
+static void start_indexing(Server *server, Client *client, char *root_path) {
+  Indexing *indexing = calloc(1, sizeof(Indexing));
+  indexing->server = server;
+  indexing->client = client;
+  indexing->root_path = strdup(root_path); // points into config->project_root
+  indexing->percentage = -1;
+  cJSON *capabilities = server->config->client_capabilities;
+  indexing->report = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(
+      cJSON_GetObjectItemCaseSensitive(capabilities, "window"), "workDoneProgress"));
+  retain_client(client);
+
+  if (indexing->report) {
+    cJSON *create = cJSON_CreateObject();
+    cJSON_AddStringToObject(create, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(create, "id", INDEXING_PROGRESS_TOKEN);
+    cJSON_AddStringToObject(create, "method", "window/workDoneProgress/create");
+    cJSON *params = cJSON_AddObjectToObject(create, "params");
+    cJSON_AddStringToObject(params, "token", INDEXING_PROGRESS_TOKEN);
+    send_json(client, create);
+    cJSON_Delete(create);
+  }
+  flush_output(client);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_indexing, indexing) != 0) {
+    log_error("Couldn't start indexing thread, indexing in the foreground");
+    run_indexing(indexing);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// The trace setting only raises the log level, `off` goes back to --log-level
+static void apply_trace(Config *config, const cJSON *value) {
+  if (!cJSON_IsString(value)) {
+    return;
+  }
+  LogLevel level = config->log_level;
+  if (strcmp(value->valuestring, "messages") == 0 && level < LOG_DEBUG) {
+    level = LOG_DEBUG;
+  } else if (strcmp(value->valuestring, "verbose") == 0) {
+    level = LOG_TRACE;
+  }
+  set_log_level(level);
 }
 
 void initialize(Server *server, Client *client, Request *request) {
   log_info("Initializing...");
 
   Config *config = server->config;
+  char *workspace = NULL;
+  const cJSON *params = request_params(request);
+  apply_trace(config, cJSON_GetObjectItemCaseSensitive(params, "trace"));
 
-  const cJSON *process_id = cJSON_GetObjectItemCaseSensitive(request->params, "processId");
+  const cJSON *process_id = cJSON_GetObjectItemCaseSensitive(params, "processId");
   if (cJSON_IsNumber(process_id)) {
     config->client_process_id = process_id->valueint;
   }
-  const cJSON *client_info = cJSON_GetObjectItemCaseSensitive(request->params, "clientInfo");
+  const cJSON *client_info = cJSON_GetObjectItemCaseSensitive(params, "clientInfo");
   if (client_info != NULL) {
     const cJSON *client_name = cJSON_GetObjectItemCaseSensitive(client_info, "name");
     if (cJSON_IsString(client_name) && (client_name->valuestring != NULL)) {
@@ -121,23 +288,31 @@ void initialize(Server *server, Client *client, Request *request) {
     if (cJSON_IsString(client_version) && (client_version->valuestring != NULL)) {
       config->client_version = strdup(client_version->valuestring);
     }
-    const cJSON *root_uri = cJSON_GetObjectItemCaseSensitive(request->params, "rootUri");
-    if (cJSON_IsString(root_uri) && (root_uri->valuestring != NULL)) {
-      config->project_root = strdup(root_uri->valuestring);
-    }
+  }
 
-    const cJSON *capabilities = cJSON_GetObjectItemCaseSensitive(request->params, "capabilities");
-    if (cJSON_IsObject(capabilities)) {
-      config->client_capabilities = cJSON_Duplicate(capabilities, true);
-    }
+  const cJSON *root_uri = cJSON_GetObjectItemCaseSensitive(params, "rootUri");
+  if (cJSON_IsString(root_uri) && (root_uri->valuestring != NULL)) {
+    config->project_root = strdup(root_uri->valuestring);
+  }
 
-    if (config->project_root) {
-      char *file_path = get_file_path(config->project_root);
-      if (is_dir(file_path)) {
-        process_file_tree(server, file_path);
-      } else if (is_file(file_path)) {
-        process_file(server, file_path);
-      }
+  // kept for the whole session, copied out of the request arena
+  const cJSON *capabilities = cJSON_GetObjectItemCaseSensitive(params, "capabilities");
+  const cJSON *options = cJSON_GetObjectItemCaseSensitive(params, "initializationOptions");
+  Arena *arena = arena_enter(NULL);
+  if (cJSON_IsObject(capabilities)) {
+    config->client_capabilities = cJSON_Duplicate(capabilities, true);
+  }
+  if (cJSON_IsObject(options)) {
+    config->initialization_options = cJSON_Duplicate(options, true);
+  }
+  arena_enter(arena);
+
+  if (config->project_root) {
+    char *file_path = get_file_path(config->project_root);
+    if (is_dir(file_path)) {
+      workspace = file_path;
+    } else if (is_file(file_path)) {
+      process_file(server, file_path);
     }
   }
 
@@ -166,22 +341,39 @@ void initialize(Server *server, Client *client, Request *request) {
   cJSON_AddItemToObject(response, "id", req_id);
   cJSON_AddItemToObject(response, "result", result);
 
-  char *json_str = cJSON_PrintUnformatted(response);
-  send_response(client->socket, 200, json_str);
+  send_json(client, response);
   log_info("Server initialized");
-
-  print_sources(server->sources);
   cJSON_Delete(response);
+
+  if (workspace) {
+    start_indexing(server, client, workspace);
+  }
 }
 
-void shutdown_server(Server *server, Client *client) {
+void shutdown_server(Server *server, Client *client, Request *request) {
   log_info("Shutting down");
   server->status = SHUTDOWN;
-  send_response(client->socket, 200, "");
+
+  cJSON *response = cJSON_CreateObject();
+  cJSON_AddItemToObject(response, "jsonrpc", cJSON_CreateString("2.0"));
+  cJSON_AddItemToObject(response, "id", cJSON_CreateNumber(request->id));
+  cJSON_AddItemToObject(response, "result", cJSON_CreateNull());
+  send_json(client, response);
+  cJSON_Delete(response);
 }
 
 void exit_server(Server *server) {
   log_info("Exiting");
+  if (server->config->stats_file) {
+    pthread_rwlock_rdlock(&server->index_lock);
+    size_t sources = arrlen(server->sources);
+    size_t constants = shlen(server->parsed_info->consts);
+    pthread_rwlock_unlock(&server->index_lock);
+    dump_stats(server->config->stats_file, sources, constants);
+  }
+  for (Client *client = server->clients; client; client = client->next) {
+    flush_output(client);
+  }
   if (server->status == SHUTDOWN) {
     exit(0);
   } else {
@@ -189,123 +381,145 @@ void exit_server(Server *server) {
   }
 }
 
+// Document text is the bulk of didOpen and didChange, so their params are
+// scanned instead of parsed and the text is unescaped straight into the buffer
+// the source keeps.
 void text_document_did_open(Server *server, Client *client, Request *request) {
-  log_info("Opening document...");
-  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(request->params, "textDocument");
+  log_debug("Opening document...");
+  JsonSpan text_document, key, value;
+  JsonSpan json_uri = {0}, json_language_id = {0}, json_text = {0};
+  JsonCursor cursor;
 
-  if (cJSON_IsObject(text_document)) {
-    char *uri;
-    char *language_id;
-    char *text;
-
-    const cJSON *json_uri = cJSON_GetObjectItemCaseSensitive(text_document, "uri");
-    if (cJSON_IsString(json_uri) && (json_uri->valuestring != NULL)) {
-      uri = strdup(json_uri->valuestring);
-    } else {
-      log_error("Couldn't parse URI");
-      return;
-    }
-
-    const cJSON *json_language_id = cJSON_GetObjectItemCaseSensitive(text_document, "languageId");
-    if (cJSON_IsString(json_language_id) && (json_language_id->valuestring != NULL)) {
-      language_id = strdup(json_language_id->valuestring);
-    } else {
-      log_error("Couldn't parse language id");
-      return;
+  if (!json_get(request->raw_params, "textDocument", &text_document) ||
+      !json_enter(text_document, &cursor)) {
+    log_error("Couldn't parse text document");
+    return;
+  }
+  while (json_next_member(&cursor, &key, &value)) {
+    if (json_key_equals(key, "uri")) {
+      json_uri = value;
+    } else if (json_key_equals(key, "languageId")) {
+      json_language_id = value;
+    } else if (json_key_equals(key, "text")) {
+      json_text = value;
     }
+  }
 
-    const cJSON *json_text = cJSON_GetObjectItemCaseSensitive(text_document, "text");
-    if (cJSON_IsString(json_text) && (json_text->valuestring != NULL)) {
-      text = strdup(json_text->valuestring);
-    } else {
-      log_error("Couldn't parse text");
-      return;
-    }
+  char *uri = json_string_dup(json_uri);
+  if (uri == NULL) {
+    log_error("Couldn't parse URI");
+    return;
+  }
+  char *language_id = json_string_dup(json_language_id);
+  if (language_id == NULL) {
+    log_error("Couldn't parse language id");
+    free(uri);
+    return;
+  }
+  bool supported = is_includes(SUPPORTED_LANGUAGE_IDS, ARRAY_LENGTH(SUPPORTED_LANGUAGE_IDS), language_id);
+  free(language_id);
+  char *text = supported ? json_string_dup(json_text) : NULL;
+  if (supported && text == NULL) {
+    log_error("Couldn't parse text");
+  }
 
-    if (is_includes(SUPPORTED_LANGUAGE_IDS, language_id) && uri != NULL) {
-      char *file_path = get_file_path(uri);
-      Source *source = get_source(server, file_path);
-      if (source) {
-        if (source->open_status != OPENED) {
-          process_content(server, file_path, text);
-          source->open_status = OPENED;
-        } else {
-          log_error("Source has already been opened");
-        }
-      } else {
-        log_info("Adding new source");
-        source = add_source(server, file_path, text);
+  if (text != NULL) {
+    char *file_path = get_file_path(uri);
+    pthread_rwlock_wrlock(&server->index_lock);
+    Source *source = get_source(server, file_path);
+    if (source) {
+      if (source->open_status != OPENED) {
+        process_content(server, file_path, text);
         source->open_status = OPENED;
+      } else {
+        log_error("Source has already been opened");
+        free(text);
       }
+    } else {
+      log_debug("Adding new source");
+      process_content(server, file_path, text);
     }
-  } else {
-    log_error("Couldn't parse text document");
-    return;
+    pthread_rwlock_unlock(&server->index_lock);
   }
+  free(uri);
 }
 
 void text_document_did_change(Server *server, Client *client, Request *request) {
-  log_info("Changing document...");
-  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(request->params, "textDocument");
-  const cJSON *content_changes =
-      cJSON_GetObjectItemCaseSensitive(request->params, "contentChanges");
+  log_debug("Changing document...");
+  JsonSpan text_document, json_uri, content_changes, change, json_text;
+  JsonCursor cursor;
 
-  char *uri;
-  if (cJSON_IsObject(text_document)) {
-    const cJSON *json_uri = cJSON_GetObjectItemCaseSensitive(text_document, "uri");
-    if (cJSON_IsString(json_uri) && (json_uri->valuestring != NULL)) {
-      uri = strdup(json_uri->valuestring);
-    } else {
-      log_error("Couldn't parse URI");
-      return;
-    }
-  } else {
+  if (!json_get(request->raw_params, "textDocument", &text_document)) {
     log_error("Couldn't parse text document");
     return;
   }
+  if (!json_get(text_document, "uri", &json_uri) || !json_is_string(json_uri)) {
+    log_error("Couldn't parse URI");
+    return;
+  }
+  if (!json_get(request->raw_params, "contentChanges", &content_changes) ||
+      !json_enter(content_changes, &cursor)) {
+    log_error("Couldn't parse content changes");
+    return;
+  }
 
-  if (cJSON_IsArray(content_changes)) {
-    cJSON *element = NULL;
-    // it's supported full document update only atm, so array should contain
-    // only one element with `text` key
-    cJSON_ArrayForEach(element, content_changes) {
-      cJSON *json_text = cJSON_GetObjectItemCaseSensitive(element, "text");
-
-      if (cJSON_IsString(json_text) && (json_text->valuestring != NULL)) {
-        char *text = json_text->valuestring;
-        char *file_path = get_file_path(uri);
-        Source *source = get_source(server, file_path);
-        if (source) {
-          if (source->open_status == OPENED) {
-            process_content(server, file_path, text);
-          } else {
-            log_error("Source not found");
-            return;
-          }
-        } else {
-          log_error("Source should be opened first");
-          return;
-        }
-      } else {
-        log_error("Couldn't parse text");
-        return;
-      }
+  // it's supported full document update only atm, every change carries the
+  // whole text, so only the last one is applied
+  JsonSpan last_change = {0};
+  while (json_next_element(&cursor, &change)) {
+    last_change = change;
+  }
+  if (last_change.length == 0) {
+    return;
+  }
+  char *text = NULL;
+  if (json_get(last_change, "text", &json_text)) {
+    text = json_string_dup(json_text);
+  }
+  if (text == NULL) {
+    log_error("Couldn't parse text");
+    return;
+  }
+
+  char *uri = json_string_dup(json_uri);
+  char *file_path = get_file_path(uri);
+  pthread_rwlock_wrlock(&server->index_lock);
+  Source *source = get_source(server, file_path);
+  bool changed = false;
+  if (source) {
+    if (source->open_status == OPENED) {
+      // the text is updated now, parsing waits until the changes pause
+      sync_source(server, file_path, text);
+      source->dirty = changed = true;
+    } else {
+      log_error("Source not found");
+      free(text);
     }
   } else {
-    log_error("Couldn't parse content changes");
-    return;
+    log_error("Source should be opened first");
+    free(text);
+  }
+  pthread_rwlock_unlock(&server->index_lock);
+  free(uri);
+
+  if (changed && server->config->debounce_ms == 0) {
+    reparse_dirty_sources(server);
+  } else if (changed) {
+    // every change pushes the deadline back
+    timer_start(server->reparse_timer, server->config->debounce_ms, 0);
   }
 }
 
-void text_document_did_close(Server *server, Request *request) {
-  log_info("Closing document...");
-  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(request->params, "textDocument");
+void text_document_did_close(Server *server, Client *client, Request *request) {
+  log_debug("Closing document...");
+  const cJSON *params = request_params(request);
+  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(params, "textDocument");
 
   char *uri;
   if (cJSON_IsObject(text_document)) {
     const cJSON *json_uri = cJSON_GetObjectItemCaseSensitive(text_document, "uri");
     if (cJSON_IsString(json_uri) && (json_uri->valuestring != NULL)) {
-      uri = strdup(json_uri->valuestring);
+      uri = json_uri->valuestring;
     } else {
       log_error("Couldn't parse URI");
       return;
@@ -316,16 +530,50 @@ void text_document_did_close(Server *server, Request *request) {
   }
 
   char *file_path = get_file_path(uri);
+  pthread_rwlock_wrlock(&server->index_lock);
   Source *source = get_source(server, file_path);
   if (source) {
     source->open_status = CLOSED;
-    log_info("Source closed");
+    log_debug("Source closed");
   } else {
     log_error("Source not found");
   }
+  pthread_rwlock_unlock(&server->index_lock);
 }
 
-void initialized(Server *server, Client *client) { log_info("Initialized"); }
+void initialized(Server *server, Client *client, Request *request) { log_info("Initialized"); }
+
+// Requests still queued or running on a worker answer with RequestCancelled,
+// the ones already answered are ignored
+void cancel_pending_request(Server *server, Client *client, Request *request) {
+  const cJSON *id = cJSON_GetObjectItemCaseSensitive(request_params(request), "id");
+  if (!cJSON_IsNumber(id)) {
+    log_error("Couldn't parse id of the cancelled request");
+    return;
+  }
+  if (cancel_request(client, id->valueint)) {
+    log_debug("Cancelling request %d", id->valueint);
+  }
+}
+
+void set_trace(Server *server, Client *client, Request *request) {
+  apply_trace(server->config, cJSON_GetObjectItemCaseSensitive(request_params(request), "value"));
+}
+
+// Counters and per-method latencies since the server started, see stats.h
+void frls_stats(Server *server, Client *client, Request *request) {
+  pthread_rwlock_rdlock(&server->index_lock);
+  size_t sources = arrlen(server->sources);
+  size_t constants = shlen(server->parsed_info->consts);
+  pthread_rwlock_unlock(&server->index_lock);
+
+  cJSON *response = cJSON_CreateObject();
+  cJSON_AddItemToObject(response, "jsonrpc", cJSON_CreateString("2.0"));
+  cJSON_AddItemToObject(response, "id", cJSON_CreateNumber(request->id));
+  cJSON_AddItemToObject(response, "result", stats_to_json(sources, constants));
+  send_json(client, response);
+  cJSON_Delete(response);
+}
 
 // Go to definition
 bool node_supports_go_to_definition(pm_node_t *node) {
@@ -335,13 +583,10 @@ bool node_supports_go_to_definition(pm_node_t *node) {
 pm_node_t *get_node_by_position(Source *source, size_t line, size_t character) {
   line++; // prism lines indexed by 1
 
-  VisitArgs *args = malloc(sizeof(VisitArgs));
-  args->found_node = NULL;
-  args->line = line;
-  args->character = character;
-  traverse_ast(source->root, source->parser, find_node_by_location, args);
+  VisitArgs args = {.found_node = NULL, .line = line, .character = character};
+  traverse_ast(source->root, source->parser, find_node_by_location, &args);
 
-  return args->found_node;
+  return args.found_node;
 }
 
 Location *get_locations_by_position(Server *server, Source *source, size_t line, size_t character) {
@@ -350,7 +595,7 @@ Location *get_locations_by_position(Server *server, Source *source, size_t line,
   pm_node_t *node = get_node_by_position(source, line, character);
 
   if (node == NULL) {
-    log_info("Node not found");
+    log_debug("Node not found");
   } else {
     if (node_supports_go_to_definition(node))
       switch (PM_NODE_TYPE(node)) {
@@ -361,46 +606,99 @@ Location *get_locations_by_position(Server *server, Source *source, size_t line,
         pm_constant_t *constant =
             pm_constant_pool_id_to_constant(&source->parser->constant_pool, cast->name);
 
+        // requests look up concurrently under the read lock, shget stores its
+        // result in the map
         char *node_name = strndup((char *)constant->start, constant->length);
-        for (int i = 0; i < hmlen(server->parsed_info->consts); i++) {
-          if (strcmp(server->parsed_info->consts[i].value->const_name, node_name) == 0) {
-            locs = server->parsed_info->consts[i].value->locations;
+        ConstHM *consts = server->parsed_info->consts;
+        if (consts) {
+          ptrdiff_t i;
+          stbds_hmget_key_ts(consts, sizeof(*consts), node_name, sizeof(consts->key), &i,
+                             STBDS_HM_STRING);
+          if (i >= 0) {
+            locs = consts[i].value->locations;
           }
         }
+        free(node_name);
       }
       default: {
         break;
       }
       }
     else {
-      log_info("Node doesn't support go to definition");
+      log_debug("Node doesn't support go to definition");
     }
   }
 
   return locs;
 }
 
+static void write_position(JsonWriter *writer, Position *position) {
+  json_write_literal(writer, "{\"line\":");
+  json_write_number(writer, position->line);
+  json_write_literal(writer, ",\"character\":");
+  json_write_number(writer, position->character);
+  json_write_literal(writer, "}");
+}
+
+static void write_location(JsonWriter *writer, Location *location) {
+  json_write_literal(writer, "{\"uri\":");
+  json_write_raw(writer, location->uri, strlen(location->uri));
+  json_write_literal(writer, ",\"range\":{\"start\":");
+  write_position(writer, location->start);
+  json_write_literal(writer, ",\"end\":");
+  write_position(writer, location->end);
+  json_write_literal(writer, "}}");
+}
+
+// Popular constants have hundreds of locations, they're printed straight into
+// the response body instead of building a cJSON tree and printing that
+static void send_locations(Client *client, Request *request, Location *locations) {
+  size_t count = arrlen(locations);
+  JsonWriter writer;
+  json_writer_init(&writer, 64 + count * 160);
+  json_write_literal(&writer, "{\"jsonrpc\":\"2.0\",\"id\":");
+  json_write_number(&writer, request->id);
+  json_write_literal(&writer, ",\"result\":");
+
+  if (count == 0) {
+    log_debug("No locations found");
+    json_write_literal(&writer, "null");
+  } else if (count == 1) {
+    write_location(&writer, locations);
+  } else {
+    json_write_literal(&writer, "[");
+    for (size_t i = 0; i < count; ++i) {
+      if (i > 0) {
+        json_write_literal(&writer, ",");
+      }
+      write_location(&writer, &locations[i]);
+    }
+    json_write_literal(&writer, "]");
+  }
+
+  json_write_literal(&writer, "}");
+  send_response(client, json_writer_finish(&writer));
+}
+
 void go_to_definition(Server *server, Client *client, Request *request) {
-  log_info("Going to definition...");
+  log_debug("Going to definition...");
 
-  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(request->params, "textDocument");
-  const cJSON *position = cJSON_GetObjectItemCaseSensitive(request->params, "position");
+  const cJSON *params = request_params(request);
+  const cJSON *text_document = cJSON_GetObjectItemCaseSensitive(params, "textDocument");
+  const cJSON *position = cJSON_GetObjectItemCaseSensitive(params, "position");
 
   if (!(cJSON_IsObject(text_document) && cJSON_IsObject(position))) {
     invalid_params(client, request);
     return;
   }
 
-  cJSON *result = cJSON_CreateObject();
-  cJSON *response = cJSON_CreateObject();
-
   char *uri;
   size_t line;
   size_t character;
 
   const cJSON *json_uri = cJSON_GetObjectItemCaseSensitive(text_document, "uri");
   if (cJSON_IsString(json_uri) && (json_uri->valuestring != NULL)) {
-    uri = strdup(json_uri->valuestring);
+    uri = json_uri->valuestring;
   } else {
     log_error("Couldn't parse URI");
     return;
@@ -423,86 +721,26 @@ void go_to_definition(Server *server, Client *client, Request *request) {
   }
 
   char *file_path = get_file_path(uri);
-  log_info("Looking for source: %s", file_path);
+  flush_source(server, file_path);
+  log_debug("Looking for source: %s", file_path);
+  // the locations point into the index, keep it until they're serialized
+  pthread_rwlock_rdlock(&server->index_lock);
   Source *source = get_source(server, file_path);
-  log_info("Source found: %s", source ? "true" : "false");
+  log_debug("Source found: %s", source ? "true" : "false");
 
   if (source) {
     Location *locations = get_locations_by_position(server, source, line, character);
-    log_info("Locations found: %zu", arrlen(locations));
-
-    cJSON *req_id = cJSON_CreateNumber(request->id);
-    cJSON_AddItemToObject(response, "id", req_id);
-
-    if (arrlen(locations) == 0) {
-      log_info("No locations found");
-      cJSON_AddItemToObject(response, "result", cJSON_CreateNull());
-    } else if (arrlen(locations) == 1) {
-      char *uri = build_uri(locations->file_path);
-      cJSON *json_uri = cJSON_CreateString(uri);
-      cJSON_AddItemToObject(result, "uri", json_uri);
-      free(uri);
-
-      cJSON *range = cJSON_CreateObject();
-
-      cJSON *start = cJSON_CreateObject();
-      cJSON *start_line = cJSON_CreateNumber(locations->start->line);
-      cJSON *start_character = cJSON_CreateNumber(locations->start->character);
-      cJSON_AddItemToObject(start, "line", start_line);
-      cJSON_AddItemToObject(start, "character", start_character);
-      cJSON_AddItemToObject(range, "start", start);
-
-      cJSON *end = cJSON_CreateObject();
-      cJSON *end_line = cJSON_CreateNumber(locations->end->line);
-      cJSON *end_character = cJSON_CreateNumber(locations->end->character);
-      cJSON_AddItemToObject(end, "line", end_line);
-      cJSON_AddItemToObject(end, "character", end_character);
-      cJSON_AddItemToObject(range, "end", end);
-
-      cJSON_AddItemToObject(result, "range", range);
-
-      cJSON_AddItemToObject(response, "result", result);
-    } else {
-      cJSON *locs = cJSON_CreateArray();
-      for (size_t i = 0; i < arrlen(locations); ++i) {
-        cJSON *loc = cJSON_CreateObject();
-
-        char *uri = build_uri(locations[i].file_path);
-        cJSON *json_uri = cJSON_CreateString(uri);
-        cJSON_AddItemToObject(loc, "uri", json_uri);
-        free(uri);
-
-        cJSON *range = cJSON_CreateObject();
-
-        cJSON *start = cJSON_CreateObject();
-        cJSON *start_line = cJSON_CreateNumber(locations[i].start->line);
-        cJSON *start_character = cJSON_CreateNumber(locations[i].start->character);
-        cJSON_AddItemToObject(start, "line", start_line);
-        cJSON_AddItemToObject(start, "character", start_character);
-        cJSON_AddItemToObject(range, "start", start);
-
-        cJSON *end = cJSON_CreateObject();
-        cJSON *end_line = cJSON_CreateNumber(locations[i].end->line);
-        cJSON *end_character = cJSON_CreateNumber(locations[i].end->character);
-        cJSON_AddItemToObject(end, "line", end_line);
-        cJSON_AddItemToObject(end, "character", end_character);
-        cJSON_AddItemToObject(range, "end", end);
-
-        cJSON_AddItemToObject(loc, "range", range);
-
-        cJSON_AddItemToArray(locs, loc);
-      }
-      cJSON_AddItemToObject(response, "result", locs);
+    log_debug("Locations found: %zu", arrlen(locations));
+    if (is_request_cancelled()) {
+      pthread_rwlock_unlock(&server->index_lock);
+      request_cancelled(client, request);
+      return;
     }
 
-    char *json_str = cJSON_PrintUnformatted(response);
-    send_response(client->socket, 200, json_str);
+    send_locations(client, request, locations);
   } else {
-    log_info("Source not found");
-    cJSON *req_id = cJSON_CreateNumber(request->id);
-    cJSON_AddItemToObject(response, "id", req_id);
-    cJSON_AddItemToObject(response, "result", cJSON_CreateNull());
-    char *json_str = cJSON_PrintUnformatted(response);
-    send_response(client->socket, 200, json_str);
+    log_debug("Source not found");
+    send_locations(client, request, NULL);
   }
+  pthread_rwlock_unlock(&server->index_lock);
 }
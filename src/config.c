@@ -8,9 +8,13 @@
 #include "utils.h"
 
 Config *create_config(int argc, char *argv[]) {
-  Config *config = malloc(sizeof(Config));
+  Config *config = calloc(1, sizeof(Config));
   config->host = HOST;
   config->port = PORT;
+  config->output_high_water = OUTPUT_HIGH_WATER;
+  config->threads = WORKER_THREADS;
+  config->debounce_ms = DEBOUNCE_MS;
+  config->log_level = LOG_LEVEL;
 
   if (argc == 1) {
     return config;
@@ -35,6 +39,34 @@ Config *create_config(int argc, char *argv[]) {
         config->host[strlen(ptr->value)] = '\0';
       } else if (strcmp(ptr->key, "port") == 0) {
         config->port = atoi(ptr->value);
+      } else if (strcmp(ptr->key, "output-high-water") == 0) {
+        config->output_high_water = strtoull(ptr->value, NULL, 10);
+      } else if (strcmp(ptr->key, "threads") == 0) {
+        config->threads = strtoull(ptr->value, NULL, 10);
+      } else if (strcmp(ptr->key, "index-threads") == 0) {
+        config->index_threads = strtoull(ptr->value, NULL, 10);
+      } else if (strcmp(ptr->key, "git-index") == 0) {
+        if (strcmp(ptr->value, "all") == 0) {
+          config->git_index = GIT_INDEX_ALL;
+        } else {
+          config->git_index = strcmp(ptr->value, "false") != 0 ? GIT_INDEX_ON : GIT_INDEX_OFF;
+        }
+      } else if (strcmp(ptr->key, "debounce") == 0) {
+        config->debounce_ms = strtoull(ptr->value, NULL, 10);
+      } else if (strcmp(ptr->key, "log-level") == 0) {
+        if (!parse_log_level(ptr->value, &config->log_level)) {
+          log_error("Unknown log level `%s`, using info", ptr->value);
+        }
+      } else if (strcmp(ptr->key, "log-file") == 0) {
+        config->log_file = strdup(ptr->value);
+      } else if (strcmp(ptr->key, "stats-file") == 0) {
+        config->stats_file = strdup(ptr->value);
+      } else if (strcmp(ptr->key, "trace-file") == 0) {
+        config->trace_file = strdup(ptr->value);
+      } else if (strcmp(ptr->key, "record") == 0) {
+        config->record_file = strdup(ptr->value);
+      } else if (strcmp(ptr->key, "stdio") == 0) {
+        config->stdio = strcmp(ptr->value, "false") != 0;
       }
       free(ptr->key);
       free(ptr->value);
@@ -48,20 +80,37 @@ Config *create_config(int argc, char *argv[]) {
 }
 
 void print_config(Config *config) {
-  log_info("Config contents:");
-  printf("Host: %s\n", config->host);
-  printf("Port: %d\n", config->port);
-  printf("Project root: %s\n", config->project_root);
-  printf("Client process id: %d\n", config->client_process_id);
-  printf("Client name: %s\n", config->client_name);
-  printf("Client version: %s\n", config->client_version);
+  log_debug("Config contents:");
+  log_debug("Host: %s", config->host);
+  log_debug("Port: %d", config->port);
+  log_debug("Stdio: %s", config->stdio ? "true" : "false");
+  log_debug("Output high water: %zu", config->output_high_water);
+  log_debug("Threads: %zu", config->threads);
+  log_debug("Index threads: %zu", config->index_threads);
+  log_debug("Git index: %s", config->git_index == GIT_INDEX_OFF   ? "off"
+                             : config->git_index == GIT_INDEX_ALL ? "all"
+                                                                  : "on");
+  log_debug("Debounce: %zums", config->debounce_ms);
+  log_debug("Log file: %s", config->log_file ? config->log_file : "stderr");
+  log_debug("Stats file: %s", config->stats_file ? config->stats_file : "none");
+  log_debug("Trace file: %s", config->trace_file ? config->trace_file : "none");
+  log_debug("Recording: %s", config->record_file ? config->record_file : "none");
+  log_debug("Project root: %s", config->project_root);
+  log_debug("Client process id: %d", config->client_process_id);
+  log_debug("Client name: %s", config->client_name);
+  log_debug("Client version: %s", config->client_version);
 }
 
 void destroy_config(Config *config) {
   free(config->host);
   free(config->project_root);
+  free(config->log_file);
+  free(config->stats_file);
+  free(config->trace_file);
+  free(config->record_file);
   free(config->client_name);
   free(config->client_version);
-  cJSON_free(config->client_capabilities);
+  cJSON_Delete(config->client_capabilities);
+  cJSON_Delete(config->initialization_options);
   free(config);
 }
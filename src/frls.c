@@ -1,8 +1,19 @@
 #include "config.h"
+#include "log.h"
+#include "record.h"
 #include "server.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
   Config *config = create_config(argc, argv);
+  set_log_level(config->log_level);
+  start_logger(config->log_file);
+  if (config->trace_file) {
+    start_tracing(config->trace_file);
+  }
+  if (config->record_file) {
+    start_recording(config->record_file);
+  }
   Server *server = create_server(config);
   start_server(server);
   destroy_server(server);
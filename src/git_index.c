@@ -0,0 +1,187 @@
+#include "git_index.h"
+#include "stb_ds.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_HEADER_SIZE 12
+#define INDEX_CHECKSUM_SIZE 20
+// ctime, mtime, dev, ino, mode, uid, gid, size, blob id and flags
+#define ENTRY_FIXED_SIZE 62
+
+#define FLAG_EXTENDED 0x4000
+#define FLAG_NAME_STAGE 0x3000
+#define EXTENDED_SKIP_WORKTREE 0x4000
+#define EXTENDED_INTENT_TO_ADD 0x2000
+#define MODE_TYPE 0170000
+#define MODE_REGULAR 0100000
+
+static uint32_t read_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t read_be16(const unsigned char *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+// Version 4 prefixes each path with how much of the previous one to drop
+static bool read_varint(const unsigned char **p, const unsigned char *end, size_t *value) {
+  if (*p >= end) {
+    return false;
+  }
+  unsigned char c = *(*p)++;
+  size_t result = c & 127;
+  while (c & 128) {
+    if (*p >= end) {
+      return false;
+    }
+    c = *(*p)++;
+    result = ((result + 1) << 7) | (c & 127);
+  }
+  *value = result;
+  return true;
+}
+
+// `.git` is a file pointing elsewhere in worktrees and submodules
+static bool index_path(const char *root_path, char *path, size_t size) {
+  char dot_git[PATH_MAX];
+  snprintf(dot_git, sizeof(dot_git), "%s/.git", root_path);
+  struct stat dot_git_stat;
+  if (stat(dot_git, &dot_git_stat) != 0) {
+    return false;
+  }
+  if (S_ISDIR(dot_git_stat.st_mode)) {
+    snprintf(path, size, "%s/index", dot_git);
+    return true;
+  }
+
+  FILE *file = fopen(dot_git, "r");
+  if (!file) {
+    return false;
+  }
+  char line[PATH_MAX];
+  bool found = fgets(line, sizeof(line), file) && is_starts_with(line, "gitdir: ");
+  fclose(file);
+  if (!found) {
+    return false;
+  }
+  char *git_dir = trim(line + strlen("gitdir: "));
+  if (git_dir[0] == '/') {
+    snprintf(path, size, "%s/index", git_dir);
+  } else {
+    snprintf(path, size, "%s/%s/index", root_path, git_dir);
+  }
+  return true;
+}
+
+static bool parse_index(const unsigned char *data, size_t size, GitIndexEntry **entries) {
+  if (size < INDEX_HEADER_SIZE + INDEX_CHECKSUM_SIZE || memcmp(data, "DIRC", 4) != 0) {
+    return false;
+  }
+  uint32_t version = read_be32(data + 4);
+  if (version < 2 || version > 4) {
+    log_error("Unsupported git index version %u", version);
+    return false;
+  }
+  uint32_t count = read_be32(data + 8);
+
+  const unsigned char *p = data + INDEX_HEADER_SIZE;
+  const unsigned char *end = data + size - INDEX_CHECKSUM_SIZE;
+  char *path = NULL; // the previous path too, for version 4
+  size_t path_length = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if ((size_t)(end - p) < ENTRY_FIXED_SIZE) {
+      arrfree(path);
+      return false;
+    }
+    const unsigned char *entry = p;
+    uint16_t flags = read_be16(entry + 60);
+    uint16_t extended = 0;
+    p += ENTRY_FIXED_SIZE;
+    if (flags & FLAG_EXTENDED) {
+      if (version < 3 || end - p < 2) {
+        arrfree(path);
+        return false;
+      }
+      extended = read_be16(p);
+      p += 2;
+    }
+
+    size_t dropped = 0;
+    if (version == 4 && (!read_varint(&p, end, &dropped) || dropped > path_length)) {
+      arrfree(path);
+      return false;
+    }
+    const unsigned char *nul = memchr(p, '\0', end - p);
+    if (!nul) {
+      arrfree(path);
+      return false;
+    }
+    size_t kept = version == 4 ? path_length - dropped : 0;
+    path_length = kept + (nul - p);
+    arrsetlen(path, path_length + 1);
+    memcpy(path + kept, p, nul - p);
+    path[path_length] = '\0';
+    // entries before version 4 are NUL-padded to a multiple of 8 bytes
+    p = version == 4 ? nul + 1 : entry + ((p - entry + (nul - p) + 8) & ~(size_t)7);
+    if (p > end) {
+      arrfree(path);
+      return false;
+    }
+
+    uint32_t mode = read_be32(entry + 24);
+    if ((flags & FLAG_NAME_STAGE) || (extended & (EXTENDED_SKIP_WORKTREE | EXTENDED_INTENT_TO_ADD)) ||
+        (mode & MODE_TYPE) != MODE_REGULAR) {
+      continue;
+    }
+    GitIndexEntry index_entry = {.path = strdup(path), .size = read_be32(entry + 36)};
+    arrput(*entries, index_entry);
+  }
+  arrfree(path);
+  return true;
+}
+
+bool read_git_index(const char *root_path, GitIndexEntry **entries) {
+  char path[PATH_MAX];
+  if (!index_path(root_path, path, sizeof(path))) {
+    return false;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat index_stat;
+  if (fstat(fd, &index_stat) != 0 || index_stat.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    log_error("Couldn't map `%s`: %s", path, strerror(errno));
+    return false;
+  }
+
+  *entries = NULL;
+  bool parsed = parse_index(data, index_stat.st_size, entries);
+  munmap(data, index_stat.st_size);
+  if (!parsed) {
+    log_error("Couldn't read the git index `%s`", path);
+    free_git_index(*entries);
+    *entries = NULL;
+  }
+  return parsed;
+}
+
+void free_git_index(GitIndexEntry *entries) {
+  for (size_t i = 0; i < arrlenu(entries); i++) {
+    free(entries[i].path);
+  }
+  arrfree(entries);
+}
@@ -1,9 +1,465 @@
 #include "ignore.h"
+#include "stb_ds.h"
 #include "utils.h"
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-bool is_ignored_file(char *file_path) { return is_includes(IGNORE_FILES, file_name(file_path)); }
+// git never descends into these
+static const char *ALWAYS_IGNORED_DIRS[] = {".git"};
 
-bool is_ignored_dir(char *file_path) {
-  return is_includes(IGNORE_DIRECTORIES, file_name(file_path));
+typedef enum { MATCH_LITERAL, MATCH_SUFFIX, MATCH_GLOB } MatchKind;
+
+typedef struct {
+  char *pattern; // without `!` and the slashes around it, `*.log` keeps `.log`
+  MatchKind kind;
+  bool negated;
+  bool dir_only;
+  bool anchored; // matched against the path below the source's directory, not the name
+} IgnoreRule;
+
+typedef struct {
+  char *key;      // the pattern of the first rule
+  size_t *value;  // positions in rules, ascending
+} RuleHM;
+
+// Literal patterns are looked up, only suffix and glob patterns are tried one
+// by one, from the last
+struct IgnoreRules {
+  IgnoreRule *rules;
+  RuleHM *names; // literal patterns without a slash
+  RuleHM *paths; // literal patterns with one
+  size_t *suffixes;
+  size_t *globs;
+  bool has_anchored;
+};
+
+static bool has_glob_chars(const char *pattern) { return strpbrk(pattern, "*?[\\") != NULL; }
+
+static void add_position(RuleHM **map, char *key, size_t position) {
+  ptrdiff_t i = shgeti(*map, key);
+  if (i >= 0) {
+    arrput((*map)[i].value, position);
+    return;
+  }
+  size_t *positions = NULL;
+  arrput(positions, position);
+  shput(*map, key, positions);
+}
+
+static void add_rule(IgnoreRules *rules, char *line) {
+  size_t length = strlen(line);
+  // trailing spaces are dropped unless escaped
+  while (length > 0 && line[length - 1] == ' ' && !(length > 1 && line[length - 2] == '\\')) {
+    length--;
+  }
+  line[length] = '\0';
+  if (length == 0 || line[0] == '#') {
+    return;
+  }
+
+  IgnoreRule rule = {0};
+  if (line[0] == '!') {
+    rule.negated = true;
+    line++;
+    length--;
+  }
+  if (length > 0 && line[length - 1] == '/') {
+    rule.dir_only = true;
+    line[--length] = '\0';
+  }
+  if (line[0] == '/') {
+    rule.anchored = true;
+    line++;
+    length--;
+  }
+  if (length == 0) {
+    return;
+  }
+  rule.anchored = rule.anchored || strchr(line, '/') != NULL;
+
+  size_t position = arrlenu(rules->rules);
+  if (!has_glob_chars(line)) {
+    rule.kind = MATCH_LITERAL;
+    rule.pattern = strdup(line);
+    add_position(rule.anchored ? &rules->paths : &rules->names, rule.pattern, position);
+  } else if (!rule.anchored && line[0] == '*' && line[1] != '\0' && !has_glob_chars(line + 1)) {
+    rule.kind = MATCH_SUFFIX;
+    rule.pattern = strdup(line + 1);
+    arrput(rules->suffixes, position);
+  } else {
+    rule.kind = MATCH_GLOB;
+    rule.pattern = strdup(line);
+    arrput(rules->globs, position);
+  }
+  rules->has_anchored = rules->has_anchored || rule.anchored;
+  arrput(rules->rules, rule);
+}
+
+static IgnoreRules *create_rules() {
+  IgnoreRules *rules = calloc(1, sizeof(IgnoreRules));
+  if (!rules) {
+    fail("Out of memory");
+  }
+  return rules;
+}
+
+// Takes the content apart in place
+static IgnoreRules *compile_rules(char *content) {
+  IgnoreRules *rules = create_rules();
+  char *line = content;
+  while (line) {
+    char *next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    }
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '\r') {
+      line[length - 1] = '\0';
+    }
+    add_rule(rules, line);
+    line = next;
+  }
+  return rules;
+}
+
+static void free_positions(RuleHM *map) {
+  for (size_t i = 0; i < shlenu(map); i++) {
+    arrfree(map[i].value);
+  }
+  shfree(map);
+}
+
+static void destroy_rules(IgnoreRules *rules) {
+  if (!rules) {
+    return;
+  }
+  free_positions(rules->names);
+  free_positions(rules->paths);
+  for (size_t i = 0; i < arrlenu(rules->rules); i++) {
+    free(rules->rules[i].pattern);
+  }
+  arrfree(rules->rules);
+  arrfree(rules->suffixes);
+  arrfree(rules->globs);
+  free(rules);
+}
+
+// NULL if there is no such regular file
+static char *read_rules_file(int dir_fd, const char *path) {
+  int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+  char *content = malloc(file_stat.st_size + 1);
+  if (!content) {
+    fail("Out of memory");
+  }
+  size_t length = 0;
+  ssize_t got;
+  while (length < (size_t)file_stat.st_size &&
+         (got = read(fd, content + length, file_stat.st_size - length)) > 0) {
+    length += got;
+  }
+  content[length] = '\0';
+  close(fd);
+  return content;
+}
+
+// `p` is at the `[`, NULL if the class isn't closed and the `[` is literal
+static const char *class_end(const char *p) {
+  const char *q = p + 1;
+  if (*q == '!' || *q == '^') {
+    q++;
+  }
+  if (*q == ']') {
+    q++;
+  }
+  for (; *q && *q != ']'; q++) {
+    if (*q == '\\' && q[1]) {
+      q++;
+    }
+  }
+  return *q == ']' ? q : NULL;
+}
+
+static bool in_class(const char *p, const char *end, char c) {
+  p++;
+  bool negated = *p == '!' || *p == '^';
+  if (negated) {
+    p++;
+  }
+  bool found = false;
+  for (; p < end; p++) {
+    char low = *p == '\\' ? *++p : *p;
+    char high = low;
+    if (p + 2 < end && p[1] == '-') {
+      p += 2;
+      high = *p == '\\' && p + 1 < end ? *++p : *p;
+    }
+    found = found || (low <= c && c <= high);
+  }
+  return found != negated;
+}
+
+// Wildcards stop at a slash except in `**`, `**/` also matches no directory
+static bool glob_match(const char *p, const char *s) {
+  for (; *p; p++, s++) {
+    switch (*p) {
+    case '?':
+      if (*s == '\0' || *s == '/') {
+        return false;
+      }
+      break;
+    case '*':
+      if (p[1] == '*') {
+        p += 2;
+        if (*p == '/') {
+          p++;
+          for (;; s++) {
+            if (glob_match(p, s)) {
+              return true;
+            }
+            if ((s = strchr(s, '/')) == NULL) {
+              return false;
+            }
+          }
+        }
+        for (;; s++) {
+          if (glob_match(p, s)) {
+            return true;
+          }
+          if (*s == '\0') {
+            return false;
+          }
+        }
+      }
+      for (;; s++) {
+        if (glob_match(p + 1, s)) {
+          return true;
+        }
+        if (*s == '\0' || *s == '/') {
+          return false;
+        }
+      }
+    case '[': {
+      const char *end = class_end(p);
+      if (!end) {
+        if (*s != '[') {
+          return false;
+        }
+        break;
+      }
+      if (*s == '\0' || *s == '/' || !in_class(p, end, *s)) {
+        return false;
+      }
+      p = end;
+      break;
+    }
+    case '\\':
+      if (p[1]) {
+        p++;
+      }
+      // fallthrough
+    default:
+      if (*p != *s) {
+        return false;
+      }
+    }
+  }
+  return *s == '\0';
+}
+
+static bool applies(IgnoreRule *rule, bool is_dir) { return !rule->dir_only || is_dir; }
+
+// Walker threads look up concurrently, shgeti stores its result in the map
+static ptrdiff_t last_literal(IgnoreRules *rules, RuleHM *map, const char *key, bool is_dir,
+                              ptrdiff_t best) {
+  if (!map) {
+    return best;
+  }
+  ptrdiff_t i;
+  stbds_hmget_key_ts(map, sizeof(*map), (void *)key, sizeof(map->key), &i, STBDS_HM_STRING);
+  if (i < 0) {
+    return best;
+  }
+  size_t *positions = map[i].value;
+  for (ptrdiff_t j = arrlen(positions) - 1; j >= 0 && (ptrdiff_t)positions[j] > best; j--) {
+    if (applies(&rules->rules[positions[j]], is_dir)) {
+      return positions[j];
+    }
+  }
+  return best;
+}
+
+// 1 ignored, 0 included again by a `!` pattern, -1 when no pattern matches
+static int match_rules(IgnoreRules *rules, const char *path, const char *name, bool is_dir) {
+  ptrdiff_t best = last_literal(rules, rules->names, name, is_dir, -1);
+  if (path) {
+    best = last_literal(rules, rules->paths, path, is_dir, best);
+  }
+
+  size_t name_length = strlen(name);
+  for (ptrdiff_t i = arrlen(rules->suffixes) - 1; i >= 0; i--) {
+    size_t position = rules->suffixes[i];
+    if ((ptrdiff_t)position <= best) {
+      break;
+    }
+    IgnoreRule *rule = &rules->rules[position];
+    size_t suffix_length = strlen(rule->pattern);
+    if (applies(rule, is_dir) && name_length >= suffix_length &&
+        memcmp(name + name_length - suffix_length, rule->pattern, suffix_length) == 0) {
+      best = position;
+      break;
+    }
+  }
+
+  for (ptrdiff_t i = arrlen(rules->globs) - 1; i >= 0; i--) {
+    size_t position = rules->globs[i];
+    if ((ptrdiff_t)position <= best) {
+      break;
+    }
+    IgnoreRule *rule = &rules->rules[position];
+    if (applies(rule, is_dir) && glob_match(rule->pattern, rule->anchored ? path : name)) {
+      best = position;
+      break;
+    }
+  }
+
+  return best < 0 ? -1 : !rules->rules[best].negated;
+}
+
+// Builds the path below the source's directory only if a pattern needs it
+static int match_source(IgnoreRules *rules, size_t dir_length, const char *dir_path,
+                        const char *name, bool is_dir) {
+  if (!rules) {
+    return -1;
+  }
+  char path[PATH_MAX];
+  const char *relative = NULL;
+  if (rules->has_anchored) {
+    const char *below = dir_path + dir_length;
+    while (*below == '/') {
+      below++;
+    }
+    if (*below) {
+      snprintf(path, sizeof(path), "%s/%s", below, name);
+      relative = path;
+    } else {
+      relative = name;
+    }
+  }
+  return match_rules(rules, relative, name, is_dir);
+}
+
+Ignore *create_ignore(const char *root_path, const cJSON *excludes) {
+  Ignore *ignore = calloc(1, sizeof(Ignore));
+  if (!ignore) {
+    fail("Out of memory");
+  }
+  ignore->root_length = strlen(root_path);
+  pthread_mutex_init(&ignore->lock, NULL);
+
+  if (cJSON_IsArray(excludes)) {
+    ignore->excludes = create_rules();
+    const cJSON *exclude;
+    cJSON_ArrayForEach(exclude, excludes) {
+      if (cJSON_IsString(exclude)) {
+        char *line = strdup(exclude->valuestring);
+        add_rule(ignore->excludes, line);
+        free(line);
+      }
+    }
+  }
+
+  char info_exclude[PATH_MAX];
+  snprintf(info_exclude, sizeof(info_exclude), "%s/.git/info/exclude", root_path);
+  char *content = read_rules_file(AT_FDCWD, info_exclude);
+  if (content) {
+    ignore->info_exclude = compile_rules(content);
+    free(content);
+  }
+  return ignore;
+}
+
+void destroy_ignore(Ignore *ignore) {
+  destroy_rules(ignore->excludes);
+  destroy_rules(ignore->info_exclude);
+  for (size_t i = 0; i < arrlenu(ignore->levels); i++) {
+    destroy_rules(ignore->levels[i]->rules);
+    free(ignore->levels[i]);
+  }
+  arrfree(ignore->levels);
+  pthread_mutex_destroy(&ignore->lock);
+  free(ignore);
+}
+
+IgnoreLevel *enter_ignore_level(Ignore *ignore, IgnoreLevel *parent, int dir_fd,
+                                const char *dir_path) {
+  char *content = read_rules_file(dir_fd, ".gitignore");
+  if (!content) {
+    return parent;
+  }
+  IgnoreLevel *level = malloc(sizeof(IgnoreLevel));
+  if (!level) {
+    fail("Out of memory");
+  }
+  level->parent = parent;
+  level->rules = compile_rules(content);
+  level->dir_length = strlen(dir_path);
+  free(content);
+
+  pthread_mutex_lock(&ignore->lock);
+  arrput(ignore->levels, level);
+  pthread_mutex_unlock(&ignore->lock);
+  return level;
+}
+
+bool is_excluded(Ignore *ignore, const char *path) {
+  if (!ignore->excludes) {
+    return false;
+  }
+  // every directory on the way is matched too, `tmp/` excludes tmp/a/b.rb
+  char dir_path[PATH_MAX] = "";
+  size_t dir_length = 0;
+  const char *name = path;
+  while (true) {
+    const char *slash = strchr(name, '/');
+    size_t name_length = slash ? (size_t)(slash - name) : strlen(name);
+    char part[PATH_MAX];
+    snprintf(part, sizeof(part), "%.*s", (int)name_length, name);
+    if (match_source(ignore->excludes, 0, dir_path, part, slash != NULL) == 1) {
+      return true;
+    }
+    if (!slash) {
+      return false;
+    }
+    dir_length += snprintf(dir_path + dir_length, sizeof(dir_path) - dir_length, "%s%s",
+                           dir_length > 0 ? "/" : "", part);
+    name = slash + 1;
+  }
+}
+
+bool is_ignored(Ignore *ignore, IgnoreLevel *level, const char *dir_path, const char *name,
+                bool is_dir) {
+  if (is_dir && is_includes(ALWAYS_IGNORED_DIRS, ARRAY_LENGTH(ALWAYS_IGNORED_DIRS), (char *)name)) {
+    return true;
+  }
+  int decision = match_source(ignore->excludes, ignore->root_length, dir_path, name, is_dir);
+  for (; decision < 0 && level; level = level->parent) {
+    decision = match_source(level->rules, level->dir_length, dir_path, name, is_dir);
+  }
+  if (decision < 0) {
+    decision = match_source(ignore->info_exclude, ignore->root_length, dir_path, name, is_dir);
+  }
+  return decision == 1;
 }
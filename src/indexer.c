@@ -0,0 +1,346 @@
+#include "indexer.h"
+#include "git_index.h"
+#include "ignore.h"
+#include "stb_ds.h"
+#include "trace.h"
+#include "utils.h"
+#include "walker.h"
+#include "workers.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Files merged per hold of the index lock, requests waiting for it get in
+// between batches
+#define MERGE_BATCH_FILES 256
+
+typedef struct {
+  WorkerPool *pool; // indexing yields to its foreground jobs, NULL without workers
+  IndexFile **order; // largest file first
+  size_t count;
+  size_t next; // position in order of the next file to parse
+  // parsed files waiting to be merged, in the order they were done
+  pthread_mutex_t lock;
+  pthread_cond_t parsed;
+  IndexFile **done;
+  size_t done_count;
+} IndexQueue;
+
+typedef struct {
+  char *key;    // the full path
+  size_t value; // position in the listed files
+} TrackedHM;
+
+typedef struct {
+  char *key; // owned by the source of a document opened during indexing
+  bool value;
+} OpenedHM;
+
+typedef struct {
+  Ignore *ignore;
+  // with --git-index=all, the files listed from the index, marked as the walk finds them
+  TrackedHM *tracked;
+  bool *seen;
+} Listing;
+
+static bool is_ruby_file(const char *name) {
+  size_t length = strlen(name);
+  return length > 3 && strcmp(name + length - 3, ".rb") == 0;
+}
+
+// The way the walker joins them, a root can end with a slash
+static void join_path(char *path, size_t size, const char *dir_path, const char *name) {
+  size_t dir_length = strlen(dir_path);
+  bool slash = dir_length > 0 && dir_path[dir_length - 1] != '/';
+  snprintf(path, size, "%s%s%s", dir_path, slash ? "/" : "", name);
+}
+
+// Walker threads look up concurrently, shgeti stores its result in the map
+static bool mark_tracked(Listing *listing, const char *dir_path, const char *name) {
+  char path[PATH_MAX];
+  join_path(path, sizeof(path), dir_path, name);
+  ptrdiff_t i;
+  stbds_hmget_key_ts(listing->tracked, sizeof(*listing->tracked), path,
+                     sizeof(listing->tracked->key), &i, STBDS_HM_STRING);
+  if (i < 0) {
+    return false;
+  }
+  __atomic_store_n(&listing->seen[listing->tracked[i].value], true, __ATOMIC_RELAXED);
+  return true;
+}
+
+static void *open_dir(void *arg, void *parent, int fd, const char *dir_path) {
+  Listing *listing = arg;
+  return enter_ignore_level(listing->ignore, parent, fd, dir_path);
+}
+
+// The name is checked before the ignore rules, most files aren't Ruby. Tracked
+// files are already listed and, like in git, aren't subject to .gitignore.
+static bool accept_entry(void *arg, void *state, const char *dir_path, const char *name,
+                         bool is_dir) {
+  Listing *listing = arg;
+  if (!is_dir) {
+    if (!is_ruby_file(name)) {
+      return false;
+    }
+    if (listing->tracked && mark_tracked(listing, dir_path, name)) {
+      return false;
+    }
+  }
+  return !is_ignored(listing->ignore, state, dir_path, name, is_dir);
+}
+
+// Ruby files from the index, without the ones excluded in initializationOptions
+static IndexFile *list_tracked_files(char *root_path, GitIndexEntry *entries, Ignore *ignore) {
+  IndexFile *files = NULL;
+  for (size_t i = 0; i < arrlenu(entries); i++) {
+    GitIndexEntry *entry = &entries[i];
+    if (!is_ruby_file(entry->path) || is_excluded(ignore, entry->path)) {
+      continue;
+    }
+    char path[PATH_MAX];
+    join_path(path, sizeof(path), root_path, entry->path);
+    IndexFile file = {.path = strdup(path), .size = entry->size};
+    arrput(files, file);
+  }
+  return files;
+}
+
+// Reading the git index lists a warm 45k file tree about 7 times faster than
+// the walk, but untracked files can be in any directory and cost the walk
+// again, they're only looked for with --git-index=all. Tracked files that walk
+// didn't find are gone from the work tree or under an ignored directory.
+static IndexFile *list_files(Config *config, char *root_path, size_t thread_count) {
+  Listing listing = {.ignore = create_ignore(root_path, cJSON_GetObjectItemCaseSensitive(
+                                                            config->initialization_options,
+                                                            "exclude"))};
+  IndexFile *files = NULL;
+  GitIndexEntry *entries = NULL;
+  bool from_git = config->git_index != GIT_INDEX_OFF && read_git_index(root_path, &entries);
+  if (from_git) {
+    files = list_tracked_files(root_path, entries, listing.ignore);
+    free_git_index(entries);
+    log_info("%zu Ruby files tracked in the git index", arrlenu(files));
+  } else if (config->git_index != GIT_INDEX_OFF) {
+    log_info("No git index in `%s`, walking the workspace", root_path);
+  }
+
+  if (!from_git || config->git_index == GIT_INDEX_ALL) {
+    size_t tracked_count = arrlenu(files);
+    for (size_t i = 0; i < tracked_count; i++) {
+      shput(listing.tracked, files[i].path, i);
+    }
+    listing.seen = calloc(tracked_count + 1, sizeof(bool));
+    WalkFilter filter = {.open_dir = open_dir, .accept = accept_entry, .arg = &listing};
+    WalkFile *found = walk_tree(root_path, thread_count, &filter);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < tracked_count; i++) {
+      if (listing.seen[i]) {
+        files[kept++] = files[i];
+      } else {
+        free(files[i].path);
+      }
+    }
+    arrsetlen(files, kept);
+    for (size_t i = 0; i < arrlenu(found); i++) {
+      IndexFile file = {.path = found[i].path, .size = found[i].size};
+      arrput(files, file);
+    }
+    if (from_git) {
+      log_info("%zu untracked Ruby files", arrlenu(found));
+    }
+    arrfree(found);
+    free(listing.seen);
+  }
+
+  shfree(listing.tracked);
+  destroy_ignore(listing.ignore);
+  return files;
+}
+
+// A file deleted since it was listed is left out
+static void index_file(IndexFile *file) {
+  uint64_t started = trace_begin();
+  char *content = readall(file->path);
+  trace_end("readall", file->path, started);
+  if (!content) {
+    return;
+  }
+
+  Source *source = create_source(file->path, content);
+  source->open_status = CLOSED;
+  if (parse_source(source)) {
+    file->consts = extract_consts(source);
+  }
+  file->source = source;
+}
+
+// The editor opened the file while it was parsed, its source is already there
+static void drop_source(Source *source) {
+  if (source->parser) {
+    free((void *)source->parser->start); // the copy parse_source made
+    pm_parser_free(source->parser);
+    free(source->parser);
+  }
+  free(source->root);
+  free(source->content);
+  free(source->uri);
+  free(source->file_path);
+  free(source);
+}
+
+static void *run_indexer(void *arg) {
+  IndexQueue *queue = arg;
+  while (true) {
+    size_t position = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+    if (position >= queue->count) {
+      return NULL;
+    }
+    IndexFile *file = queue->order[position];
+    scheduler_yield(queue->pool);
+    index_file(file);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->done[queue->done_count++] = file;
+    pthread_cond_signal(&queue->parsed);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+// Largest first, a big file picked up last would leave one thread working alone
+static int compare_sizes(const void *a, const void *b) {
+  size_t x = (*(IndexFile *const *)a)->size;
+  size_t y = (*(IndexFile *const *)b)->size;
+  return (x < y) - (x > y);
+}
+
+static int compare_locations(const void *a, const void *b) {
+  const Location *x = a, *y = b;
+  int paths = strcmp(x->file_path, y->file_path);
+  if (paths != 0) {
+    return paths;
+  }
+  if (x->start->line != y->start->line) {
+    return x->start->line < y->start->line ? -1 : 1;
+  }
+  return (x->start->character > y->start->character) - (x->start->character < y->start->character);
+}
+
+// Files are merged in the order they're parsed, which varies between runs
+static void sort_locations(ParsedInfo *parsed_info) {
+  for (size_t i = 0; i < shlenu(parsed_info->consts); i++) {
+    Location *locations = parsed_info->consts[i].value->locations;
+    qsort(locations, arrlenu(locations), sizeof(Location), compare_locations);
+  }
+}
+
+// One core is left to the I/O thread and the workers by default
+static size_t indexer_threads(Config *config) {
+  if (config->index_threads > 0) {
+    return config->index_threads;
+  }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 1 ? cores - 1 : 1;
+}
+
+void index_workspace(Server *server, char *root_path, IndexProgress progress, void *arg) {
+  size_t thread_count = indexer_threads(server->config);
+  IndexFile *files = list_files(server->config, root_path, thread_count);
+  size_t count = arrlen(files);
+  progress(arg, 0, count);
+
+  IndexQueue queue = {.pool = server->workers,
+                      .order = malloc(count * sizeof(IndexFile *)),
+                      .count = count,
+                      .done = malloc(count * sizeof(IndexFile *))};
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.parsed, NULL);
+  for (size_t i = 0; i < count; i++) {
+    queue.order[i] = &files[i];
+  }
+  qsort(queue.order, count, sizeof(IndexFile *), compare_sizes);
+
+  if (thread_count > count) {
+    thread_count = count;
+  }
+  log_info("Indexing %zu files on %zu threads", count, thread_count);
+
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  size_t started_threads = 0;
+  for (size_t i = 0; i < thread_count; i++) {
+    if (pthread_create(&threads[started_threads], NULL, run_indexer, &queue) != 0) {
+      log_error("Couldn't start indexing thread: %s", strerror(errno));
+      break;
+    }
+    started_threads++;
+  }
+  if (started_threads == 0 && count > 0) {
+    run_indexer(&queue);
+  }
+
+  // the index lock is taken per batch of parsed files, after the requests
+  // waiting for it
+  size_t merged = 0;
+  size_t known_sources = 0; // the sources up to here were added by the indexer
+  OpenedHM *opened = NULL;
+  while (merged < count) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.done_count == merged) {
+      pthread_cond_wait(&queue.parsed, &queue.lock);
+    }
+    size_t done = queue.done_count;
+    pthread_mutex_unlock(&queue.lock);
+    if (done - merged > MERGE_BATCH_FILES) {
+      done = merged + MERGE_BATCH_FILES;
+    }
+
+    scheduler_yield(server->workers);
+    pthread_rwlock_wrlock(&server->index_lock);
+    // sources are only appended, any past ours were opened by the editor
+    for (size_t i = known_sources; i < arrlenu(server->sources); i++) {
+      shput(opened, server->sources[i]->file_path, true);
+    }
+    for (size_t i = merged; i < done; i++) {
+      IndexFile *file = queue.done[i];
+      if (!file->source) {
+        continue;
+      }
+      if (shgeti(opened, file->path) >= 0) {
+        log_debug("`%s` was opened while indexing, keeping the editor's text", file->path);
+        drop_source(file->source);
+        continue;
+      }
+      arrput(server->sources, file->source);
+      merge_consts(server->parsed_info, file->source, file->consts);
+    }
+    known_sources = arrlenu(server->sources);
+    pthread_rwlock_unlock(&server->index_lock);
+    for (size_t i = merged; i < done; i++) {
+      shfree(queue.done[i]->consts);
+      free(queue.done[i]->path);
+    }
+    merged = done;
+    progress(arg, merged, count);
+  }
+
+  for (size_t i = 0; i < started_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  scheduler_yield(server->workers);
+  pthread_rwlock_wrlock(&server->index_lock);
+  sort_locations(server->parsed_info);
+  pthread_rwlock_unlock(&server->index_lock);
+
+  shfree(opened);
+  free(threads);
+  free(queue.order);
+  free(queue.done);
+  pthread_mutex_destroy(&queue.lock);
+  pthread_cond_destroy(&queue.parsed);
+  arrfree(files);
+}
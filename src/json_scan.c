@@ -0,0 +1,265 @@
+#include "json_scan.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *skip_whitespace(const char *c, const char *end) {
+  while (c < end && (*c == ' ' || *c == '\n' || *c == '\r' || *c == '\t'))
+    c++;
+  return c;
+}
+
+// `c` points to the opening quote, returns the position after the closing one
+static const char *skip_string(const char *c, const char *end) {
+  c++;
+  while (c < end) {
+    const char *quote = memchr(c, '"', end - c);
+    if (quote == NULL)
+      return NULL;
+
+    // the quote is escaped if it's preceded by an odd number of backslashes
+    const char *backslash = quote;
+    while (backslash > c && *(backslash - 1) == '\\')
+      backslash--;
+    if ((quote - backslash) % 2 == 0)
+      return quote + 1;
+    c = quote + 1;
+  }
+  return NULL;
+}
+
+bool json_skip_value(const char **position, const char *end) {
+  const char *c = skip_whitespace(*position, end);
+  if (c >= end)
+    return false;
+
+  if (*c == '"') {
+    c = skip_string(c, end);
+  } else if (*c == '{' || *c == '[') {
+    size_t depth = 0;
+    while (c < end) {
+      if (*c == '"') {
+        if ((c = skip_string(c, end)) == NULL)
+          return false;
+        continue;
+      }
+      if (*c == '{' || *c == '[') {
+        depth++;
+      } else if (*c == '}' || *c == ']') {
+        if (--depth == 0) {
+          c++;
+          break;
+        }
+      }
+      c++;
+    }
+    if (depth != 0)
+      return false;
+  } else {
+    // numbers, true, false, null
+    while (c < end && *c != ',' && *c != '}' && *c != ']' && *c != ' ' && *c != '\n' &&
+           *c != '\r' && *c != '\t')
+      c++;
+  }
+
+  if (c == NULL)
+    return false;
+  *position = c;
+  return true;
+}
+
+bool json_enter(JsonSpan value, JsonCursor *cursor) {
+  const char *end = value.start + value.length;
+  const char *c = skip_whitespace(value.start, end);
+  if (c >= end || (*c != '{' && *c != '['))
+    return false;
+
+  cursor->position = c + 1;
+  cursor->end = end;
+  cursor->first = true;
+  return true;
+}
+
+// Moves to the next value, false at the end of the container or on garbage
+static bool next_value(JsonCursor *cursor, JsonSpan *key, JsonSpan *value) {
+  const char *c = skip_whitespace(cursor->position, cursor->end);
+  if (c >= cursor->end || *c == '}' || *c == ']')
+    return false;
+
+  if (!cursor->first) {
+    if (*c != ',')
+      return false;
+    c = skip_whitespace(c + 1, cursor->end);
+  }
+  cursor->first = false;
+
+  if (key != NULL) {
+    if (c >= cursor->end || *c != '"')
+      return false;
+    const char *key_end = skip_string(c, cursor->end);
+    if (key_end == NULL)
+      return false;
+    key->start = c + 1;
+    key->length = key_end - c - 2;
+
+    c = skip_whitespace(key_end, cursor->end);
+    if (c >= cursor->end || *c != ':')
+      return false;
+    c = skip_whitespace(c + 1, cursor->end);
+  }
+
+  value->start = c;
+  if (!json_skip_value(&c, cursor->end))
+    return false;
+  value->length = c - value->start;
+  cursor->position = c;
+  return true;
+}
+
+bool json_next_member(JsonCursor *cursor, JsonSpan *key, JsonSpan *value) {
+  return next_value(cursor, key, value);
+}
+
+bool json_next_element(JsonCursor *cursor, JsonSpan *value) {
+  return next_value(cursor, NULL, value);
+}
+
+bool json_key_equals(JsonSpan key, const char *str) {
+  return key.length == strlen(str) && memcmp(key.start, str, key.length) == 0;
+}
+
+bool json_get(JsonSpan object, const char *key, JsonSpan *value) {
+  JsonCursor cursor;
+  JsonSpan member_key;
+  if (!json_enter(object, &cursor))
+    return false;
+
+  while (json_next_member(&cursor, &member_key, value)) {
+    if (json_key_equals(member_key, key))
+      return true;
+  }
+  return false;
+}
+
+bool json_is_string(JsonSpan value) { return value.length >= 2 && *value.start == '"'; }
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static bool read_code_unit(const char *c, const char *end, uint32_t *unit) {
+  if (end - c < 4)
+    return false;
+  *unit = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hex_digit(c[i]);
+    if (digit < 0)
+      return false;
+    *unit = (*unit << 4) | digit;
+  }
+  return true;
+}
+
+static char *encode_utf8(char *out, uint32_t code_point) {
+  if (code_point < 0x80) {
+    *out++ = code_point;
+  } else if (code_point < 0x800) {
+    *out++ = 0xC0 | (code_point >> 6);
+    *out++ = 0x80 | (code_point & 0x3F);
+  } else if (code_point < 0x10000) {
+    *out++ = 0xE0 | (code_point >> 12);
+    *out++ = 0x80 | ((code_point >> 6) & 0x3F);
+    *out++ = 0x80 | (code_point & 0x3F);
+  } else {
+    *out++ = 0xF0 | (code_point >> 18);
+    *out++ = 0x80 | ((code_point >> 12) & 0x3F);
+    *out++ = 0x80 | ((code_point >> 6) & 0x3F);
+    *out++ = 0x80 | (code_point & 0x3F);
+  }
+  return out;
+}
+
+// Unescapes a string value into a new malloc'd buffer, copying unescaped runs
+// in bulk. Returns NULL if the value isn't a valid string.
+char *json_string_dup(JsonSpan value) {
+  if (!json_is_string(value))
+    return NULL;
+
+  const char *c = value.start + 1;
+  const char *end = value.start + value.length - 1;
+  // unescaping never makes a string longer
+  char *result = malloc(end - c + 1);
+  if (!result) {
+    fail("Out of memory");
+  }
+  char *out = result;
+
+  while (c < end) {
+    const char *backslash = memchr(c, '\\', end - c);
+    const char *run_end = backslash ? backslash : end;
+    memcpy(out, c, run_end - c);
+    out += run_end - c;
+    c = run_end;
+    if (c == end)
+      break;
+
+    if (end - c < 2)
+      goto invalid;
+    char escaped = c[1];
+    c += 2;
+    switch (escaped) {
+    case '"':
+    case '\\':
+    case '/':
+      *out++ = escaped;
+      break;
+    case 'b':
+      *out++ = '\b';
+      break;
+    case 'f':
+      *out++ = '\f';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'u': {
+      uint32_t code_point;
+      if (!read_code_unit(c, end, &code_point))
+        goto invalid;
+      c += 4;
+      if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+        uint32_t low;
+        if (end - c < 6 || c[0] != '\\' || c[1] != 'u' || !read_code_unit(c + 2, end, &low) ||
+            low < 0xDC00 || low > 0xDFFF)
+          goto invalid;
+        c += 6;
+        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+      }
+      out = encode_utf8(out, code_point);
+      break;
+    }
+    default:
+      goto invalid;
+    }
+  }
+
+  *out = '\0';
+  return result;
+
+invalid:
+  free(result);
+  return NULL;
+}
@@ -0,0 +1,92 @@
+#include "json_writer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Not the arena, the finished buffer is handed to the client's output queue
+void json_writer_init(JsonWriter *writer, size_t capacity) {
+  writer->length = 0;
+  writer->capacity = capacity > 0 ? capacity : 64;
+  writer->data = malloc(writer->capacity);
+  if (!writer->data) {
+    fail("Out of memory");
+  }
+}
+
+static void reserve(JsonWriter *writer, size_t size) {
+  // one spare byte for the terminator added by json_writer_finish
+  if (writer->length + size < writer->capacity) {
+    return;
+  }
+  while (writer->length + size >= writer->capacity) {
+    writer->capacity *= 2;
+  }
+  writer->data = realloc(writer->data, writer->capacity);
+  if (!writer->data) {
+    fail("Out of memory");
+  }
+}
+
+void json_write_raw(JsonWriter *writer, const char *str, size_t length) {
+  reserve(writer, length);
+  memcpy(writer->data + writer->length, str, length);
+  writer->length += length;
+}
+
+// Quoted, with the characters JSON requires escaped
+void json_write_string(JsonWriter *writer, const char *str) {
+  size_t length = strlen(str);
+  // plain paths need no escaping, reserve for that and grow on escapes
+  reserve(writer, length + 2);
+  writer->data[writer->length++] = '"';
+
+  const char *run = str;
+  for (const char *c = str; *c; c++) {
+    unsigned char ch = *c;
+    if (ch >= 0x20 && ch != '"' && ch != '\\') {
+      continue;
+    }
+    json_write_raw(writer, run, c - run);
+    run = c + 1;
+
+    char escaped[7];
+    switch (ch) {
+    case '"':
+      json_write_literal(writer, "\\\"");
+      break;
+    case '\\':
+      json_write_literal(writer, "\\\\");
+      break;
+    case '\n':
+      json_write_literal(writer, "\\n");
+      break;
+    case '\r':
+      json_write_literal(writer, "\\r");
+      break;
+    case '\t':
+      json_write_literal(writer, "\\t");
+      break;
+    default:
+      snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+      json_write_raw(writer, escaped, 6);
+      break;
+    }
+  }
+  json_write_raw(writer, run, str + length - run);
+  json_write_literal(writer, "\"");
+}
+
+void json_write_number(JsonWriter *writer, long number) {
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%ld", number);
+  json_write_raw(writer, digits, length);
+}
+
+// Terminates the buffer and gives it to the caller
+char *json_writer_finish(JsonWriter *writer) {
+  reserve(writer, 1);
+  writer->data[writer->length] = '\0';
+  char *data = writer->data;
+  writer->data = NULL;
+  return data;
+}
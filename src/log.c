@@ -0,0 +1,163 @@
+#include "log.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define RING_MASK (LOG_RING_SLOTS - 1)
+
+// A slot is free for the producer whose ticket equals `sequence`, and holds a
+// message for the consumer when `sequence` is one past its ticket
+typedef struct {
+  size_t sequence;
+  LogLevel level;
+  char text[LOG_SLOT_SIZE];
+} LogSlot;
+
+static const char *LEVEL_NAMES[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+LogLevel log_level = LOG_LEVEL;
+
+static LogSlot ring[LOG_RING_SLOTS];
+static size_t enqueue_position; // next ticket handed to a producer
+static size_t dequeue_position; // touched by the logger thread only
+static size_t dropped;
+static sem_t ready; // posted after a message is published
+static pthread_t thread;
+static FILE *output;
+static bool running;
+static bool stopping;
+
+bool parse_log_level(const char *name, LogLevel *level) {
+  for (size_t i = 0; i < sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]); i++) {
+    if (strcasecmp(name, LEVEL_NAMES[i]) == 0) {
+      *level = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void set_log_level(LogLevel level) { __atomic_store_n(&log_level, level, __ATOMIC_RELAXED); }
+
+static void write_slot(LogSlot *slot) {
+  fprintf(output, "[%s] %s\n", LEVEL_NAMES[slot->level], slot->text);
+}
+
+// Writes everything published so far, the output is flushed once the ring is
+// empty rather than per message
+static void drain_ring() {
+  while (true) {
+    LogSlot *slot = &ring[dequeue_position & RING_MASK];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeue_position + 1) {
+      break;
+    }
+    write_slot(slot);
+    __atomic_store_n(&slot->sequence, dequeue_position + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    dequeue_position++;
+  }
+
+  size_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (lost > 0) {
+    fprintf(output, "[WARN] %zu log messages dropped, the log couldn't keep up\n", lost);
+  }
+  fflush(output);
+}
+
+static void *run_logger(void *arg) {
+  (void)arg;
+  while (true) {
+    while (sem_wait(&ready) != 0 && errno == EINTR) {
+    }
+    // a producer that took an earlier ticket may still be formatting, its
+    // post wakes us again
+    drain_ring();
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Logs to `file_path`, or stderr when it's NULL. Messages still in the ring
+// are written at exit.
+void start_logger(const char *file_path) {
+  output = stderr;
+  if (file_path) {
+    output = fopen(file_path, "a");
+    if (!output) {
+      output = stderr;
+      log_error("Couldn't open log file `%s`: %s", file_path, strerror(errno));
+    }
+  }
+
+  for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+    ring[i].sequence = i;
+  }
+  sem_init(&ready, 0, 0);
+  if (pthread_create(&thread, NULL, run_logger, NULL) != 0) {
+    fail("Couldn't start logger thread");
+  }
+  __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+  atexit(stop_logger);
+}
+
+void stop_logger() {
+  if (!__atomic_exchange_n(&running, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  sem_post(&ready);
+  pthread_join(thread, NULL);
+  sem_destroy(&ready);
+  if (output != stderr) {
+    fclose(output);
+  }
+}
+
+void log_message(LogLevel level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    // before the logger is started, e.g. while parsing options
+    fprintf(stderr, "[%s] ", LEVEL_NAMES[level]);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return;
+  }
+
+  size_t position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+  LogSlot *slot;
+  while (true) {
+    slot = &ring[position & RING_MASK];
+    size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_position, &position, position + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // full, dropping is better than stalling a request on the log
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      va_end(args);
+      return;
+    } else {
+      position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->level = level;
+  vsnprintf(slot->text, LOG_SLOT_SIZE, format, args);
+  va_end(args);
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+  sem_post(&ready);
+}
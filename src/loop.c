@@ -0,0 +1,159 @@
+#include "loop.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+Loop *create_loop() {
+  Loop *loop = calloc(1, sizeof(Loop));
+  if (!loop) {
+    fail("Out of memory");
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    fail("epoll_create1() failed");
+  }
+  return loop;
+}
+
+static bool loop_ctl(Loop *loop, int op, Watch *watch, uint32_t events) {
+  struct epoll_event event = {.events = events, .data.ptr = watch};
+  if (epoll_ctl(loop->epoll_fd, op, watch->fd, &event) < 0) {
+    log_error("epoll_ctl(%d) failed for fd %d: %s", op, watch->fd, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Fails e.g. for regular files which can't be polled
+bool loop_add(Loop *loop, Watch *watch, uint32_t events) {
+  return loop_ctl(loop, EPOLL_CTL_ADD, watch, events);
+}
+
+void loop_modify(Loop *loop, Watch *watch, uint32_t events) {
+  loop_ctl(loop, EPOLL_CTL_MOD, watch, events);
+}
+
+void loop_remove(Loop *loop, Watch *watch) { loop_ctl(loop, EPOLL_CTL_DEL, watch, 0); }
+
+// Returns the number of ready events stored in `loop->events`
+int loop_wait(Loop *loop, int timeout_ms) {
+  int ready;
+  do {
+    ready = epoll_wait(loop->epoll_fd, loop->events, MAX_EVENTS, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+
+  if (ready < 0) {
+    fail("epoll_wait() failed");
+  }
+  return ready;
+}
+
+void destroy_loop(Loop *loop) {
+  close(loop->epoll_fd);
+  free(loop);
+}
+
+Timer *create_timer(Loop *loop, TimerCallback callback, void *arg) {
+  Timer *timer = calloc(1, sizeof(Timer));
+  if (!timer) {
+    fail("Out of memory");
+  }
+
+  timer->watch.kind = WATCH_TIMER;
+  timer->watch.owner = timer;
+  timer->watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->watch.fd < 0) {
+    fail("timerfd_create() failed");
+  }
+  timer->callback = callback;
+  timer->arg = arg;
+
+  loop_add(loop, &timer->watch, EPOLLIN | EPOLLET);
+  return timer;
+}
+
+static struct timespec ms_to_timespec(uint64_t ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+  return ts;
+}
+
+// Arms the timer to fire after `timeout_ms` and then every `interval_ms`
+// (0 means once). Restarting an armed timer moves its deadline.
+void timer_start(Timer *timer, uint64_t timeout_ms, uint64_t interval_ms) {
+  struct itimerspec spec = {.it_value = ms_to_timespec(timeout_ms),
+                            .it_interval = ms_to_timespec(interval_ms)};
+  if (timeout_ms == 0) {
+    // zero disarms a timerfd, fire as soon as possible instead
+    spec.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timer->watch.fd, 0, &spec, NULL) < 0) {
+    log_error("timerfd_settime() failed: %s", strerror(errno));
+  }
+}
+
+void timer_stop(Timer *timer) {
+  struct itimerspec spec = {0};
+  timerfd_settime(timer->watch.fd, 0, &spec, NULL);
+}
+
+void timer_expired(Timer *timer) {
+  uint64_t expirations;
+  if (read(timer->watch.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    // spurious wakeup, e.g. the timer has been re-armed meanwhile
+    return;
+  }
+  timer->callback(timer, timer->arg);
+}
+
+void destroy_timer(Loop *loop, Timer *timer) {
+  loop_remove(loop, &timer->watch);
+  close(timer->watch.fd);
+  free(timer);
+}
+
+Waker *create_waker(Loop *loop, WakerCallback callback, void *arg) {
+  Waker *waker = calloc(1, sizeof(Waker));
+  if (!waker) {
+    fail("Out of memory");
+  }
+
+  waker->watch.kind = WATCH_WAKER;
+  waker->watch.owner = waker;
+  waker->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (waker->watch.fd < 0) {
+    fail("eventfd() failed");
+  }
+  waker->callback = callback;
+  waker->arg = arg;
+
+  loop_add(loop, &waker->watch, EPOLLIN | EPOLLET);
+  return waker;
+}
+
+// Safe to call from any thread, wakeups before the loop gets to it are merged
+void wake(Waker *waker) {
+  uint64_t one = 1;
+  if (write(waker->watch.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_error("Couldn't wake the loop up: %s", strerror(errno));
+  }
+}
+
+void waker_woken(Waker *waker) {
+  uint64_t count;
+  if (read(waker->watch.fd, &count, sizeof(count)) != sizeof(count)) {
+    return;
+  }
+  waker->callback(waker, waker->arg);
+}
+
+void destroy_waker(Loop *loop, Waker *waker) {
+  loop_remove(loop, &waker->watch);
+  close(waker->watch.fd);
+  free(waker);
+}
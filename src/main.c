@@ -1,42 +1,332 @@
+#include "cJSON.h"
+#include "commands.h"
+#include "optparser.h"
 #include "parser.h"
 #include "prism.h"
 #include "source.h"
+#include "stb_ds.h"
 #include "utils.h"
+#include <dirent.h>
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
-int main() {
-  char *src = readall("/Users/k0va1/dev/basecamp_timetrack/lib/basecamp_timetrack/task_summary.rb");
+// Micro-benchmarks of the parser.c hot paths, `make bench-parser`.
+//
+//     build/main [--corpus=<file or dir>]... [--samples=30] [--warmup=3]
+//                [--filter=<benchmark>] [--output=<file>]
+//
+// Every benchmark runs over each corpus file in turn, one file is one op. A
+// sample repeats the whole corpus until it takes at least SAMPLE_MIN_NS, and
+// the results are printed as JSON.
 
-  pm_parser_t parser;
-  printf("%s\n", src);
-  pm_parser_init(&parser, (const uint8_t *)src, strlen(src), NULL);
+#define DEFAULT_CORPUS "test/fixtures/project"
+#define SAMPLES 30
+#define WARMUP_SAMPLES 3
+#define SAMPLE_MIN_NS 5000000ull
 
-  pm_node_t *root = pm_parse(&parser);
+// Counts calls into the allocator by wrapping glibc's, prism, stb_ds and the
+// parser all allocate through these. Other libcs report no allocation counts.
+#ifdef __GLIBC__
+#define COUNTS_ALLOCATIONS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
 
-  VisitArgs *args = malloc(sizeof(VisitArgs));
-  args->found_node = NULL;
-  args->line = 28;
-  args->character = 22;
-  traverse_ast(root, &parser, find_node_by_location, args);
+static size_t allocations;
 
-  if (args->found_node != NULL) {
-    printf("node %zu\n", PM_NODE_TYPE(args->found_node));
-    printf("node %s\n", args->found_node->location.start);
-    size_t len = args->found_node->location.end - args->found_node->location.start;
-    printf("len %d\n", len);
-    pm_constant_id_t c =
-        pm_constant_pool_find(&parser.constant_pool, args->found_node->location.start, len);
-    printf("const id %zu\n", c);
-    pm_constant_t *constant = pm_constant_pool_id_to_constant(&parser.constant_pool, c);
-    printf("found node %s\n", strndup((char *)constant->start, constant->length));
+void *malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+#else
+#define COUNTS_ALLOCATIONS 0
+static size_t allocations;
+#endif
+
+typedef struct {
+  Source *source;
+  // zero-based position of the last constant read in the file, if there is one
+  bool has_constant;
+  size_t line;
+  size_t character;
+} CorpusFile;
+
+typedef struct {
+  CorpusFile *files;
+  size_t bytes;
+  ParsedInfo parsed_info; // every file of the corpus is indexed
+  Server server;
+} Corpus;
+
+typedef struct {
+  const char *name;
+  void (*run)(Corpus *corpus, CorpusFile *file);
+} Benchmark;
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void add_file(Corpus *corpus, char *file_path) {
+  char *ext = file_ext(file_path);
+  if (!ext || strcmp(ext, ".rb") != 0) {
+    return;
+  }
+  char *content = readall(file_path);
+  if (!content) {
+    return;
+  }
+  Source *source = calloc(1, sizeof(Source));
+  source->file_path = strdup(file_path);
+  source->uri = strdup("\"\"");
+  source->content = content;
+  corpus->bytes += strlen(source->content);
+  CorpusFile file = {.source = source};
+  arrput(corpus->files, file);
+}
+
+static void add_path(Corpus *corpus, char *path) {
+  if (!is_dir(path)) {
+    add_file(corpus, path);
+    return;
+  }
+  DIR *dir = opendir(path);
+  if (!dir) {
+    log_error("Couldn't open `%s`", path);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char child[PATH_MAX + 1];
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    add_path(corpus, child);
+  }
+  closedir(dir);
+}
+
+static void find_last_constant(pm_node_t *node, pm_parser_t *parser, void *arg) {
+  CorpusFile *file = arg;
+  if (PM_NODE_TYPE_P(node, PM_CONSTANT_READ_NODE)) {
+    pm_line_column_t start =
+        pm_newline_list_line_column(&parser->newline_list, node->location.start, parser->start_line);
+    file->has_constant = true;
+    file->line = start.line - 1;
+    file->character = start.column;
+  }
+}
+
+// Builds the index the lookups run against, the way initialize does
+static void index_corpus(Corpus *corpus) {
+  corpus->server.parsed_info = &corpus->parsed_info;
+  for (size_t i = 0; i < arrlen(corpus->files); i++) {
+    CorpusFile *file = &corpus->files[i];
+    parse(file->source, &corpus->parsed_info);
+    traverse_ast(file->source->root, file->source->parser, find_last_constant, file);
+  }
+}
+
+static void free_const_map(ConstHM *consts) {
+  for (size_t i = 0; i < hmlen(consts); i++) {
+    Const *c = consts[i].value;
+    for (size_t j = 0; j < arrlen(c->locations); j++) {
+      free(c->locations[j].file_path);
+      free(c->locations[j].start);
+      free(c->locations[j].end);
+    }
+    arrfree(c->locations);
+    free(c->const_name);
+    free(c);
+  }
+  shfree(consts);
+}
+
+// Reparses into the full index, like a didChange does
+static void bench_parse(Corpus *corpus, CorpusFile *file) {
+  parse(file->source, &corpus->parsed_info);
+}
+
+static void bench_build_const_map(Corpus *corpus, CorpusFile *file) {
+  Source *source = file->source;
+  free_const_map(build_const_map(source, source->parser, source->root, NULL));
+}
+
+static void count_node(pm_node_t *node, pm_parser_t *parser, void *arg) { (*(size_t *)arg)++; }
+
+static void bench_traverse_ast(Corpus *corpus, CorpusFile *file) {
+  size_t nodes = 0;
+  traverse_ast(file->source->root, file->source->parser, count_node, &nodes);
+}
+
+static void bench_find_node_by_location(Corpus *corpus, CorpusFile *file) {
+  // prism lines are one-based
+  VisitArgs args = {.found_node = NULL, .line = file->line + 1, .character = file->character};
+  traverse_ast(file->source->root, file->source->parser, find_node_by_location, &args);
+}
+
+static void bench_get_locations_by_position(Corpus *corpus, CorpusFile *file) {
+  get_locations_by_position(&corpus->server, file->source, file->line, file->character);
+}
+
+static const Benchmark BENCHMARKS[] = {
+    {"parse", bench_parse},
+    {"build_const_map", bench_build_const_map},
+    {"traverse_ast", bench_traverse_ast},
+    {"find_node_by_location", bench_find_node_by_location},
+    {"get_locations_by_position", bench_get_locations_by_position},
+};
+
+static void run_pass(const Benchmark *benchmark, Corpus *corpus, size_t repeat) {
+  for (size_t r = 0; r < repeat; r++) {
+    for (size_t i = 0; i < arrlen(corpus->files); i++) {
+      benchmark->run(corpus, &corpus->files[i]);
+    }
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static cJSON *run_benchmark(const Benchmark *benchmark, Corpus *corpus, size_t samples,
+                            size_t warmup) {
+  // passes per sample, doubled during the warmup until a sample is long enough
+  size_t repeat = 1;
+  for (size_t i = 0; i < warmup; i++) {
+    uint64_t started = now_ns();
+    run_pass(benchmark, corpus, repeat);
+    while (now_ns() - started < SAMPLE_MIN_NS) {
+      repeat *= 2;
+      started = now_ns();
+      run_pass(benchmark, corpus, repeat);
+    }
+  }
 
-    pm_buffer_t buffer = {0};
+  size_t ops = repeat * arrlen(corpus->files);
+  double *ns_per_op = malloc(samples * sizeof(double));
+  size_t allocated_before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < samples; i++) {
+    uint64_t started = now_ns();
+    run_pass(benchmark, corpus, repeat);
+    ns_per_op[i] = (double)(now_ns() - started) / ops;
+  }
+  size_t allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocated_before;
+
+  double sum = 0;
+  for (size_t i = 0; i < samples; i++) {
+    sum += ns_per_op[i];
+  }
+  double mean = sum / samples;
+  double squares = 0;
+  for (size_t i = 0; i < samples; i++) {
+    squares += (ns_per_op[i] - mean) * (ns_per_op[i] - mean);
+  }
+  qsort(ns_per_op, samples, sizeof(double), compare_doubles);
+
+  cJSON *result = cJSON_CreateObject();
+  cJSON_AddStringToObject(result, "name", benchmark->name);
+  cJSON_AddNumberToObject(result, "samples", samples);
+  cJSON_AddNumberToObject(result, "opsPerSample", ops);
+  cJSON *ns = cJSON_AddObjectToObject(result, "nsPerOp");
+  cJSON_AddNumberToObject(ns, "mean", mean);
+  cJSON_AddNumberToObject(ns, "median", ns_per_op[samples / 2]);
+  cJSON_AddNumberToObject(ns, "stddev", samples > 1 ? sqrt(squares / (samples - 1)) : 0);
+  cJSON_AddNumberToObject(ns, "min", ns_per_op[0]);
+  cJSON_AddNumberToObject(ns, "max", ns_per_op[samples - 1]);
+  if (COUNTS_ALLOCATIONS) {
+    cJSON_AddNumberToObject(result, "allocationsPerOp", (double)allocated / (ops * samples));
+  } else {
+    cJSON_AddNullToObject(result, "allocationsPerOp");
+  }
+  free(ns_per_op);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  size_t samples = SAMPLES;
+  size_t warmup = WARMUP_SAMPLES;
+  char *filter = NULL;
+  char *output_path = NULL;
+  Corpus corpus = {0};
+  bool has_corpus = false;
 
-    pm_prettyprint(&buffer, &parser, root);
-    printf("%s\n", buffer.value);
+  size_t length = 0;
+  ArgKV *args = parse_options(argc, argv, &length);
+  for (size_t i = 0; i < length; i++) {
+    if (strcmp(args[i].key, "corpus") == 0) {
+      add_path(&corpus, args[i].value);
+      has_corpus = true;
+    } else if (strcmp(args[i].key, "samples") == 0) {
+      samples = strtoull(args[i].value, NULL, 10);
+    } else if (strcmp(args[i].key, "warmup") == 0) {
+      warmup = strtoull(args[i].value, NULL, 10);
+    } else if (strcmp(args[i].key, "filter") == 0) {
+      filter = args[i].value;
+    } else if (strcmp(args[i].key, "output") == 0) {
+      output_path = args[i].value;
+    } else {
+      fprintf(stderr, "Unknown option `--%s`\n", args[i].key);
+      return 1;
+    }
   }
+  if (!has_corpus) {
+    add_path(&corpus, DEFAULT_CORPUS);
+  }
+  if (arrlen(corpus.files) == 0 || samples == 0) {
+    fprintf(stderr, "No .rb files in the corpus\n");
+    return 1;
+  }
+  if (warmup == 0) {
+    warmup = 1;
+  }
+
+  index_corpus(&corpus);
 
+  cJSON *report = cJSON_CreateObject();
+  cJSON *corpus_json = cJSON_AddObjectToObject(report, "corpus");
+  cJSON_AddNumberToObject(corpus_json, "files", arrlen(corpus.files));
+  cJSON_AddNumberToObject(corpus_json, "bytes", corpus.bytes);
+  cJSON_AddNumberToObject(corpus_json, "constants", shlen(corpus.parsed_info.consts));
+  cJSON *results = cJSON_AddArrayToObject(report, "benchmarks");
+  for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+    if (filter && strcmp(filter, BENCHMARKS[i].name) != 0) {
+      continue;
+    }
+    fprintf(stderr, "%s...\n", BENCHMARKS[i].name);
+    cJSON_AddItemToArray(results, run_benchmark(&BENCHMARKS[i], &corpus, samples, warmup));
+  }
+
+  char *printed = cJSON_Print(report);
+  FILE *output = output_path ? fopen(output_path, "w") : stdout;
+  if (!output) {
+    fprintf(stderr, "Couldn't write `%s`\n", output_path);
+    return 1;
+  }
+  fprintf(output, "%s\n", printed);
+  if (output != stdout) {
+    fclose(output);
+  }
   return 0;
 }
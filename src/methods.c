@@ -0,0 +1,54 @@
+#include "methods.h"
+#include "commands.h"
+#include "method_hash.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdint.h>
+#include <string.h>
+
+static void exit_notification(Server *server, Client *client, Request *request) {
+  exit_server(server);
+}
+
+static const Method METHODS[] = {
+#define METHOD(name, handler, kind, allowed_states, priority, thread)                              \
+  {name, handler, kind, allowed_states, priority, thread},
+#include "methods.def"
+#undef METHOD
+};
+
+// FNV-1a, must match scripts/gen_method_hash.rb
+static uint32_t method_hash(const char *name) {
+  uint32_t hash = 2166136261u ^ METHOD_HASH_SEED;
+  for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+    hash = (hash ^ *c) * 16777619u;
+  }
+  return hash ^ (hash >> 16);
+}
+
+const Method *lookup_method(const char *name) {
+  int index = METHOD_SLOTS[method_hash(name) & (METHOD_TABLE_SIZE - 1)];
+  if (index < 0 || strcmp(METHODS[index].name, name) != 0) {
+    return NULL;
+  }
+  return &METHODS[index];
+}
+
+size_t method_count() { return sizeof(METHODS) / sizeof(METHODS[0]); }
+
+size_t method_index(const Method *method) { return method - METHODS; }
+
+const Method *method_at(size_t index) { return &METHODS[index]; }
+
+// Runs the handler with its time, and the time spent parsing the message,
+// recorded under the method. The trace span is named after the method.
+void call_method(const Method *method, Server *server, Client *client, Request *request) {
+  const Method *outer = stats_enter_method(method);
+  uint64_t traced = trace_begin();
+  uint64_t started = stats_now();
+  method->handler(server, client, request);
+  record_phase(method, PHASE_HANDLER, stats_now() - started);
+  trace_end(method->name, NULL, traced);
+  record_phase(method, PHASE_PARSE, request->parse_time);
+  stats_enter_method(outer);
+}
@@ -5,9 +5,8 @@
 #include "string.h"
 #include "utils.h"
 
-const char *unary_args[] = {"--version", "-v", "--help", "-h"};
+const char *unary_args[] = {"--version", "-v", "--help", "-h", "--stdio", "--git-index"};
 const char *supported_commands[] = {"--version", "-v", "--help", "-h"};
-const char *supported_options[] = {"--host", "--port"};
 
 bool is_unary_arg(char *arg) {
   for (size_t i = 0; i < sizeof(unary_args) / sizeof(unary_args[0]); i++) {
@@ -34,6 +33,8 @@ ArgKV *parse_options(int argc, char *argv[], size_t *length) {
       exit(1);
     }
 
+    // flags like `--stdio` don't take a value
+    bool is_flag = is_unary_arg(key);
     key = remove_leading_dashes(key);
     size_t key_len = strlen(key);
     arg_kvs[i - 1].key = (char *)malloc(sizeof(char *) * key_len + 1);
@@ -41,7 +42,9 @@ ArgKV *parse_options(int argc, char *argv[], size_t *length) {
     arg_kvs[i - 1].key[key_len] = '\0';
 
     char *value = strtok(NULL, "=");
-    if (value == NULL) {
+    if (value == NULL && is_flag) {
+      value = "true";
+    } else if (value == NULL) {
       fprintf(stderr, "Invalid arguments. Value is empty: provide arguments in "
                       "`--key=value` format\n");
       exit(1);
@@ -1,7 +1,9 @@
 #include "parser.h"
+#include "cancel.h"
 #include "prism/ast.h"
 #include "prism/diagnostic.h"
 #include "prism/node.h"
+#include "trace.h"
 #include "utils.h"
 #include <stdint.h>
 
@@ -23,11 +25,11 @@ int get_line(pm_parser_t *parser, pm_diagnostic_t *error) {
 }
 
 // TODO: use traverse_ast for traversing
-ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node, ConstHM *consts) {
+ConstHM *build_const_map(Source *source, pm_parser_t *parser, pm_node_t *node, ConstHM *consts) {
   switch (PM_NODE_TYPE(node)) {
   case PM_PROGRAM_NODE: {
     pm_program_node_t *cast = (pm_program_node_t *)node;
-    consts = build_const_map(file_path, parser, (pm_node_t *)cast->statements, consts);
+    consts = build_const_map(source, parser, (pm_node_t *)cast->statements, consts);
     break;
   }
   case PM_STATEMENTS_NODE: {
@@ -35,17 +37,17 @@ ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node,
 
     size_t last_index = cast->body.size;
     for (uint32_t index = 0; index < last_index; index++) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->body.nodes[index], consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->body.nodes[index], consts);
     }
 
     break;
   }
   case PM_MODULE_NODE: {
     pm_module_node_t *cast = (pm_module_node_t *)node;
-    consts = build_const_map(file_path, parser, (pm_node_t *)cast->constant_path, consts);
+    consts = build_const_map(source, parser, (pm_node_t *)cast->constant_path, consts);
 
     if (cast->body != NULL) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->body, consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->body, consts);
     }
 
     break;
@@ -54,11 +56,11 @@ ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node,
     pm_module_node_t *cast = (pm_module_node_t *)node;
 
     // constant_path
-    consts = build_const_map(file_path, parser, (pm_node_t *)cast->constant_path, consts);
+    consts = build_const_map(source, parser, (pm_node_t *)cast->constant_path, consts);
 
     // body
     if (cast->body != NULL) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->body, consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->body, consts);
     }
 
     break;
@@ -78,8 +80,10 @@ ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node,
     end_pos->line = end.line - 1;
     end_pos->character = end.column;
 
-    Location l = {
-        .file_path = strndup(file_path, strlen(file_path)), .start = start_pos, .end = end_pos};
+    Location l = {.file_path = strndup(source->file_path, strlen(source->file_path)),
+                  .uri = source->uri,
+                  .start = start_pos,
+                  .end = end_pos};
     pm_constant_t *constant = pm_constant_pool_id_to_constant(&parser->constant_pool, cast->name);
     Const *c = malloc(sizeof(Const));
     c->const_name = strndup((char *)constant->start, constant->length);
@@ -90,7 +94,7 @@ ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node,
   case PM_CONSTANT_PATH_NODE: {
     pm_constant_path_node_t *cast = (pm_constant_path_node_t *)node;
     if (cast->parent != NULL) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->parent, consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->parent, consts);
     }
     // Note: child has been replaced with name (pm_constant_id_t) - no longer a node
     break;
@@ -98,16 +102,16 @@ ConstHM *build_const_map(char *file_path, pm_parser_t *parser, pm_node_t *node,
   case PM_CLASS_NODE: {
     pm_class_node_t *cast = (pm_class_node_t *)node;
     // constant_path
-    consts = build_const_map(file_path, parser, (pm_node_t *)cast->constant_path, consts);
+    consts = build_const_map(source, parser, (pm_node_t *)cast->constant_path, consts);
 
     // superclass
     if (cast->superclass != NULL) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->superclass, consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->superclass, consts);
     }
 
     // body
     if (cast->body != NULL) {
-      consts = build_const_map(file_path, parser, (pm_node_t *)cast->body, consts);
+      consts = build_const_map(source, parser, (pm_node_t *)cast->body, consts);
     }
   }
   default: {
@@ -121,9 +125,7 @@ void print_errors(pm_parser_t *parser) {
   pm_diagnostic_t *error = (pm_diagnostic_t *)parser->error_list.head;
   while (error != NULL) {
     int line = get_line(parser, error);
-    printf("Error: %s on line %d\n", error->message, line);
-    printf("Location start: %s\n", error->location.start);
-    printf("Location end: %s\n", error->location.end);
+    log_debug("Parse error on line %d: %s", line, error->message);
     error = (pm_diagnostic_t *)error->node.next;
   }
 }
@@ -134,7 +136,9 @@ bool is_equals_locations(Location *l1, Location *l2) {
          l1->end->character == l2->end->character;
 }
 
-void parse(Source *source, ParsedInfo *parsed_info) {
+// Replaces the source's tree, the text is copied because prism keeps pointing
+// into it. Returns false if prism gave up.
+bool parse_source(Source *source) {
   assert(source != NULL);
 
   if (source->parser != NULL) {
@@ -150,45 +154,63 @@ void parse(Source *source, ParsedInfo *parsed_info) {
   const uint8_t *src = (const uint8_t *)strndup(source->content, src_len);
   pm_parser_init(parser, src, src_len, NULL);
 
+  uint64_t started = trace_begin();
   pm_node_t *root = pm_parse(parser);
-  if (root != NULL) {
-    source->root = root;
-    source->parser = parser;
-    print_errors(parser);
-
-    ConstHM *source_consts = NULL;
-    source_consts = build_const_map(source->file_path, parser, root, source_consts);
-
-    if (source_consts != NULL) {
-      for (int i = 0; i < hmlen(source_consts); i++) {
-        if (shgeti(parsed_info->consts, source_consts[i].key) >= 0) {
-          Const *parsed_const = shget(parsed_info->consts, source_consts[i].key);
-
-          for (int k = 0; k < arrlen(source_consts[i].value->locations); k++) {
-            Location source_location = source_consts[i].value->locations[k];
-
-            bool has_location = false;
-            for (int j = 0; j < arrlen(parsed_const->locations); j++) {
-              Location parsed_location = parsed_const->locations[j];
-
-              if (is_equals_locations(&parsed_location, &source_location)) {
-                has_location = true;
-                break;
-              }
-            }
+  trace_end("pm_parse", source->file_path, started);
+  if (root == NULL) {
+    // prism API doesn't support returning parse errors
+    log_error("Couldn't parse `%s`", source->file_path);
+    return false;
+  }
+  source->root = root;
+  source->parser = parser;
+  print_errors(parser);
+  return true;
+}
+
+ConstHM *extract_consts(Source *source) {
+  uint64_t started = trace_begin();
+  ConstHM *consts = build_const_map(source, source->parser, source->root, NULL);
+  trace_end("build_const_map", source->file_path, started);
+  return consts;
+}
+
+// Takes over the file's constants, the locations already indexed are skipped
+void merge_consts(ParsedInfo *parsed_info, Source *source, ConstHM *source_consts) {
+  uint64_t started = trace_begin();
+  if (source_consts != NULL) {
+    for (int i = 0; i < hmlen(source_consts); i++) {
+      if (shgeti(parsed_info->consts, source_consts[i].key) >= 0) {
+        Const *parsed_const = shget(parsed_info->consts, source_consts[i].key);
+
+        for (int k = 0; k < arrlen(source_consts[i].value->locations); k++) {
+          Location source_location = source_consts[i].value->locations[k];
 
-            if (!has_location) {
-              arrpush(parsed_const->locations, source_location);
+          bool has_location = false;
+          for (int j = 0; j < arrlen(parsed_const->locations); j++) {
+            Location parsed_location = parsed_const->locations[j];
+
+            if (is_equals_locations(&parsed_location, &source_location)) {
+              has_location = true;
+              break;
             }
           }
-        } else {
-          shputi(parsed_info->consts, source_consts[i].key, source_consts[i].value);
+
+          if (!has_location) {
+            arrpush(parsed_const->locations, source_location);
+          }
         }
+      } else {
+        shputi(parsed_info->consts, source_consts[i].key, source_consts[i].value);
       }
     }
-  } else {
-    // prism API doesn't support returning parse errors
-    log_info("%d", parser->error_list.head);
+  }
+  trace_end("merge_consts", source->file_path, started);
+}
+
+void parse(Source *source, ParsedInfo *parsed_info) {
+  if (parse_source(source)) {
+    merge_consts(parsed_info, source, extract_consts(source));
   }
 }
 
@@ -204,7 +226,8 @@ bool is_matched_location(pm_node_t *node, pm_parser_t *parser, size_t line, size
 
 void traverse_ast(pm_node_t *node, pm_parser_t *parser,
                   void (*visit)(pm_node_t *, pm_parser_t *, void *), void *arg) {
-  if (node == NULL)
+  // a cancelled request doesn't need the rest of the tree
+  if (node == NULL || is_request_cancelled())
     return;
 
   visit(node, parser, arg);
@@ -576,7 +599,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CLASS_NODE: {
     pm_class_node_t *cast = (pm_class_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // constant_path
     { traverse_ast((pm_node_t *)cast->constant_path, parser, visit, arg); }
 
@@ -645,7 +668,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CONSTANT_AND_WRITE_NODE: {
     pm_constant_and_write_node_t *cast = (pm_constant_and_write_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // value
     { traverse_ast((pm_node_t *)cast->value, parser, visit, arg); }
 
@@ -654,7 +677,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CONSTANT_OPERATOR_WRITE_NODE: {
     pm_constant_operator_write_node_t *cast = (pm_constant_operator_write_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // value
     { traverse_ast((pm_node_t *)cast->value, parser, visit, arg); }
 
@@ -663,7 +686,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CONSTANT_OR_WRITE_NODE: {
     pm_constant_or_write_node_t *cast = (pm_constant_or_write_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // value
     { traverse_ast((pm_node_t *)cast->value, parser, visit, arg); }
 
@@ -672,7 +695,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CONSTANT_PATH_AND_WRITE_NODE: {
     pm_constant_path_and_write_node_t *cast = (pm_constant_path_and_write_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // target
     { traverse_ast((pm_node_t *)cast->target, parser, visit, arg); }
 
@@ -684,7 +707,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   case PM_CONSTANT_PATH_NODE: {
     pm_constant_path_node_t *cast = (pm_constant_path_node_t *)node;
 
-    printf("class\n");
+    log_trace("class");
     // parent
     {
       if (cast->parent == NULL) {
@@ -752,7 +775,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
 
     pm_constant_t *constant = pm_constant_pool_id_to_constant(&parser->constant_pool, cast->name);
 
-    printf("const %s\n", strndup(constant->start, constant->length));
+    log_trace("const %.*s", (int)constant->length, constant->start);
 
     break;
   }
@@ -1234,7 +1257,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
 
     pm_constant_t *constant = pm_constant_pool_id_to_constant(&parser->constant_pool, cast->name);
 
-    printf("instance var %s\n", strndup((char *)constant->start, constant->length));
+    log_trace("instance var %.*s", (int)constant->length, constant->start);
     break;
   }
   case PM_INSTANCE_VARIABLE_TARGET_NODE: {
@@ -1269,7 +1292,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   }
   case PM_INTERPOLATED_SYMBOL_NODE: {
     pm_interpolated_symbol_node_t *cast = (pm_interpolated_symbol_node_t *)node;
-    printf("symbol node\n");
+    log_trace("symbol node");
 
     break;
   }
@@ -1343,7 +1366,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
 
     pm_constant_t *constant = pm_constant_pool_id_to_constant(&parser->constant_pool, cast->name);
 
-    printf("local var %s\n", strndup((char *)constant->start, constant->length));
+    log_trace("local var %.*s", (int)constant->length, constant->start);
 
     break;
   }
@@ -1401,7 +1424,7 @@ void traverse_ast(pm_node_t *node, pm_parser_t *parser,
   }
   case PM_MODULE_NODE: {
     pm_module_node_t *cast = (pm_module_node_t *)node;
-    printf("module\n");
+    log_trace("module");
 
     // constant_path
     { traverse_ast((pm_node_t *)cast->constant_path, parser, visit, arg); }
@@ -1931,16 +1954,15 @@ void find_node_by_location(pm_node_t *node, pm_parser_t *parser, void *arg) {
 void print_consts(ParsedInfo *parsed_info) {
   if (parsed_info->consts != NULL) {
     for (int i = 0; i < hmlen(parsed_info->consts); i++) {
-      printf("Const name: %s\n", parsed_info->consts[i].key);
+      log_debug("Const name: %s", parsed_info->consts[i].key);
       for (int j = 0; j < arrlen(parsed_info->consts[i].value->locations); j++) {
-        printf("Location: file=%s\n Start line=%zu character=%zu\n End line=%zu character=%zu\n",
-               parsed_info->consts[i].value->locations[j].file_path,
-               parsed_info->consts[i].value->locations[j].start->line,
-               parsed_info->consts[i].value->locations[j].start->character,
-               parsed_info->consts[i].value->locations[j].end->line,
-               parsed_info->consts[i].value->locations[j].end->character);
-      }
-      printf("\n");
+        log_debug("Location: file=%s start=%zu:%zu end=%zu:%zu",
+                  parsed_info->consts[i].value->locations[j].file_path,
+                  parsed_info->consts[i].value->locations[j].start->line,
+                  parsed_info->consts[i].value->locations[j].start->character,
+                  parsed_info->consts[i].value->locations[j].end->line,
+                  parsed_info->consts[i].value->locations[j].end->character);
+      }
     }
   }
 }
@@ -0,0 +1,42 @@
+#include "record.h"
+#include "stats.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static FILE *output;
+static uint64_t started_at;
+
+// Only the I/O thread reads messages, so it's the only writer. The file is
+// buffered by stdio and flushed at exit.
+void start_recording(const char *file_path) {
+  output = fopen(file_path, "w");
+  if (!output) {
+    log_error("Couldn't open recording `%s`: %s", file_path, strerror(errno));
+    return;
+  }
+  setvbuf(output, NULL, _IOFBF, 1 << 16);
+  fputs(RECORDING_MAGIC, output);
+  started_at = stats_now();
+  atexit(stop_recording);
+}
+
+void stop_recording() {
+  if (output) {
+    fclose(output);
+    output = NULL;
+  }
+}
+
+void record_frame(unsigned client_id, const char *body, size_t length) {
+  if (!output) {
+    return;
+  }
+  fprintf(output, "%lu %u %zu\n", (unsigned long)((stats_now() - started_at) / 1000), client_id,
+          length);
+  fwrite(body, 1, length, output);
+  fputc('\n', output);
+}
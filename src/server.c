@@ -1,78 +1,116 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
+#include "arena.h"
 #include "cJSON.h"
 #include "commands.h"
 #include "config.h"
+#include "methods.h"
+#include "record.h"
 #include "server.h"
+#include "stats.h"
 #include "transport.h"
 #include "utils.h"
+#include "workers.h"
 
 void drop_client(Server *server, Client *client) {
+  loop_remove(server->loop, &client->watch);
+  close_client(client);
   close(client->socket);
 
-  Client **p = &server->clients;
-  while (*p) {
-    if (*p == client) {
-      *p = client->next;
-      free(client);
-      log_info("Client dropped");
-      return;
-    }
-    p = &(*p)->next;
+  if (client->prev) {
+    client->prev->next = client->next;
+  } else {
+    server->clients = client->next;
   }
+  if (client->next) {
+    client->next->prev = client->prev;
+  }
+  // jobs still running for the client hold their own references
+  release_client(client);
+  log_info("Client dropped");
 
-  fail("drop_client not found");
-}
-
-Client *create_client() {
-  Client *client = (Client *)calloc(1, sizeof(Client));
-  if (!client) {
-    fail("Out of memory");
+  if (server->config->stdio) {
+    // the editor has gone, nobody else can connect
+    exit_server(server);
   }
-  client->address_length = sizeof(client->address);
-  return client;
 }
 
-Client *add_client(Server *server) {
-  Client *client = create_client();
-  client->next = server->clients;
-  client->socket = accept(server->server_socket, (struct sockaddr *)&(client->address),
-                          &(client->address_length));
+// Accepts every pending connection, the listener is edge-triggered
+void add_clients(Server *server) {
+  while (true) {
+    Client *client = create_client();
+    client->socket = accept4(server->server_socket, (struct sockaddr *)&(client->address),
+                             &(client->address_length), SOCK_NONBLOCK | SOCK_CLOEXEC);
+    client->output = client->socket;
+
+    if (client->socket < 0) {
+      int accept_errno = errno;
+      release_client(client);
+      if (accept_errno == EAGAIN || accept_errno == EWOULDBLOCK || accept_errno == EINTR) {
+        return;
+      }
+      log_error("accept() failed: %s", strerror(accept_errno));
+      return;
+    }
 
-  if (client->socket < 0) {
-    fail("accept() failed");
-  }
+    // responses are coalesced by writev already, Nagle would only delay them
+    int option = 1;
+    setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
 
-  server->clients = client;
-  return client;
+    client->watch.fd = client->socket;
+    client->next = server->clients;
+    if (server->clients) {
+      server->clients->prev = client;
+    }
+    server->clients = client;
+    loop_add(server->loop, &client->watch, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+  }
 }
 
-void wait_on_clients(Server *server) {
-  memcpy(server->working_set, server->master_set, sizeof(fd_set));
-  SOCKET max_socket = server->server_socket;
+// The editor is the only client in stdio mode: it writes to our stdin and
+// reads from our stdout.
+void add_stdio_client(Server *server) {
+  Client *client = create_client();
+  client->socket = STDIN_FILENO;
+  client->output = STDOUT_FILENO;
+  client->watch.fd = STDIN_FILENO;
+  server->clients = client;
 
-  struct Client *client = server->clients;
-  while (client) {
-    FD_SET(client->socket, server->working_set);
-    if (client->socket > max_socket)
-      max_socket = client->socket;
-    client = client->next;
+  struct stat stat_buf;
+  if (fstat(STDOUT_FILENO, &stat_buf) == 0 && !S_ISREG(stat_buf.st_mode)) {
+    client->output_watch.fd = STDOUT_FILENO;
+    int flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+    fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+    loop_add(server->loop, &client->output_watch, EPOLLOUT | EPOLLET);
   }
-  if (select(max_socket + 1, server->working_set, NULL, NULL, NULL) < 0) {
-    fail("select() failed");
+
+  if (fstat(STDIN_FILENO, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+    // regular files can't be polled (e.g. a replayed session), just read it through
+    server->blocking_input = true;
+  } else {
+    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    loop_add(server->loop, &client->watch, EPOLLIN | EPOLLRDHUP | EPOLLET);
   }
+  log_info("Listening on stdio");
 }
 
 void send_error(Client *client, Request *req, char *error_msg, int err_code) {
@@ -85,7 +123,7 @@ void send_error(Client *client, Request *req, char *error_msg, int err_code) {
   cJSON *error = cJSON_CreateObject();
 
   code = cJSON_CreateNumber(err_code);
-  log_error(error_msg);
+  log_error("%s", error_msg);
   message = cJSON_CreateString(error_msg);
   cJSON_AddItemToObject(error, "code", code);
   cJSON_AddItemToObject(error, "message", message);
@@ -97,8 +135,7 @@ void send_error(Client *client, Request *req, char *error_msg, int err_code) {
   cJSON_AddItemToObject(body, "id", req_id);
   cJSON_AddItemToObject(body, "error", error);
 
-  char *json_str = cJSON_PrintUnformatted(body);
-  send_response(client->socket, 200, json_str);
+  send_json(client, body);
   cJSON_Delete(body);
 }
 
@@ -122,52 +159,192 @@ void invalid_params(Client *client, Request *req) {
   char *params = cJSON_PrintUnformatted(req->params);
   char *msg = concat_strings("Invalid params: ", params);
   send_error(client, req, msg, INVALID_PARAMS);
+  cJSON_free(params);
   free(msg);
 }
 
-void process_client_message(Server *server, Client *client) {
-  Request *req = create_request(client->request);
-  if (req != NULL) {
-    char *method = req->method;
-
-    log_info("method: %s", method);
-    switch (server->status) {
-    case INITIALIZED: {
-      if (strcmp(method, "initialized") == 0) {
-        initialized(server, client);
-      } else if (strcmp(method, "shutdown") == 0) {
-        shutdown_server(server, client);
-      } else if (strcmp(method, "exit") == 0) {
-        exit_server(server);
-      } else if (strcmp(method, "textDocument/didOpen") == 0) {
-        text_document_did_open(server, client, req);
-      } else if (strcmp(method, "textDocument/didChange") == 0) {
-        text_document_did_change(server, client, req);
-      } else if (strcmp(method, "textDocument/didClose") == 0) {
-        text_document_did_close(server, req);
-        // Language features
-      } else if (strcmp(method, "textDocument/definition") == 0) {
-        go_to_definition(server, client, req);
-      } else {
-        fprintf(stderr, "Unsupported method `%s`\n", method);
+void request_cancelled(Client *client, Request *req) {
+  send_error(client, req, "Request has been cancelled", RequestCancelled);
+}
+
+void method_not_found(Client *client, Request *req) {
+  char *msg = concat_strings("Unsupported method: ", req->method);
+  send_error(client, req, msg, MethodNotFound);
+  free(msg);
+}
+
+// Handlers parse params themselves, messages that are dropped or refused never
+// get that far. Only requests are answered with an error, notifications that
+// can't be handled are dropped.
+void dispatch_request(Server *server, Client *client, Request *req) {
+  const Method *method = lookup_method(req->method);
+
+  log_debug("method: %s", req->method);
+  count_stat(COUNTER_MESSAGES, 1);
+  if (method && (method->allowed_states & IN_STATE(server->status))) {
+    if (method->kind == METHOD_REQUEST && !req->has_id) {
+      log_error("Request `%s` without id", req->method);
+      return;
+    }
+    if (server->workers == NULL) {
+      call_method(method, server, client, req);
+    } else if (method->thread == ON_WORKER || method->thread == ON_WORKER_BLOCKING) {
+      submit_job(server->workers, client, req, method);
+    } else {
+      if (method->thread == ON_IO_THREAD_DRAINED) {
+        drain_worker_pool(server->workers);
       }
-      break;
+      call_method(method, server, client, req);
     }
-    case UNINITIALIZED: {
-      if (strcmp(method, "initialize") == 0) {
-        initialize(server, client, req);
-      } else {
-        uninitialized_error(client, req);
+    return;
+  }
+
+  if (!req->has_id) {
+    log_debug("Dropping notification `%s`", req->method);
+    return;
+  }
+  switch (server->status) {
+  case UNINITIALIZED:
+    uninitialized_error(client, req);
+    break;
+  case INITIALIZED:
+    if (method) {
+      send_error(client, req, "Server has already been initialized", INVALID_REQUEST);
+    } else {
+      method_not_found(client, req);
+    }
+    break;
+  case SHUTDOWN:
+    invalid_request(client, req);
+    break;
+  }
+}
+
+// A client that doesn't read its responses stops being read from, the rest of
+// its messages wait in the framer until the output drains.
+bool is_backed_up(Server *server, Client *client) {
+  if (pending_output(client) < server->config->output_high_water) {
+    return false;
+  }
+  flush_output(client);
+  size_t pending = pending_output(client);
+  if (pending < server->config->output_high_water) {
+    return false;
+  }
+
+  if (!client->paused) {
+    log_info("Client output is backed up (%zu bytes), pausing reads", pending);
+    client->paused = true;
+  }
+  return true;
+}
+
+static bool is_waiting(Client *client) {
+  return __atomic_load_n(&client->waiting, __ATOMIC_ACQUIRE);
+}
+
+// Messages after a blocking one can't be dispatched before it's done
+static bool is_blocking(Server *server, Request *req) {
+  const Method *method = lookup_method(req->method);
+  return server->workers && method && method->thread == ON_WORKER_BLOCKING;
+}
+
+// Looked up in the raw params, superseded changes are dropped unparsed
+static bool did_change_uri(Request *req, JsonSpan *uri) {
+  JsonSpan text_document;
+  return strcmp(req->method, "textDocument/didChange") == 0 &&
+         json_get(req->raw_params, "textDocument", &text_document) &&
+         json_get(text_document, "uri", uri) && json_is_string(*uri);
+}
+
+// True if the change replaces the whole document, i.e. there is a content
+// change without a range
+static bool is_full_change(Request *req) {
+  JsonSpan content_changes, change, range;
+  JsonCursor cursor;
+  if (!json_get(req->raw_params, "contentChanges", &content_changes) ||
+      !json_enter(content_changes, &cursor)) {
+    return false;
+  }
+  while (json_next_element(&cursor, &change)) {
+    if (!json_get(change, "range", &range)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Within a run of didChange notifications a document replaced by a later full
+// change doesn't need to be synced and reparsed. Nothing can observe the
+// intermediate text because any other message ends the run.
+void coalesce_changes(Request **batch, size_t count) {
+  size_t run_start = 0;
+
+  for (size_t i = 0; i <= count; i++) {
+    JsonSpan uri, next_uri;
+    if (i < count && did_change_uri(batch[i], &uri)) {
+      continue;
+    }
+
+    for (size_t j = run_start; j < i; j++) {
+      did_change_uri(batch[j], &uri);
+      for (size_t k = j + 1; k < i; k++) {
+        did_change_uri(batch[k], &next_uri);
+        if (uri.length == next_uri.length && memcmp(uri.start, next_uri.start, uri.length) == 0 &&
+            is_full_change(batch[k])) {
+          log_debug("Skipping superseded change of %.*s", (int)uri.length, uri.start);
+          destroy_request(batch[j]);
+          batch[j] = NULL;
+          break;
+        }
       }
-      break;
     }
-    case SHUTDOWN: {
-      invalid_request(client, req);
-      break;
+    run_start = i + 1;
+  }
+}
+
+// Handles every complete message buffered for the client, parsing them in
+// batches. Returns false if the stream is broken and the client should be
+// dropped.
+bool process_client_message(Server *server, Client *client) {
+  Request *batch[MAX_BATCH_SIZE];
+  FrameStatus status = FRAME_READY;
+  Arena *previous = arena_enter(server->arena);
+
+  while (status == FRAME_READY && !is_waiting(client) && !is_backed_up(server, client)) {
+    Frame frame;
+    size_t count = 0;
+    uint64_t started = stats_now();
+    while (count < MAX_BATCH_SIZE &&
+           (status = framer_next(client->framer, &frame)) == FRAME_READY) {
+      uint64_t framed = stats_now();
+      record_frame(client->id, frame.body, frame.body_length);
+      Request *req = create_request(frame.headers, frame.body, frame.body_length);
+      uint64_t scanned = stats_now();
+      if (req != NULL) {
+        record_phase(lookup_method(req->method), PHASE_FRAME, framed - started);
+        req->parse_time = scanned - framed;
+        batch[count++] = req;
+        if (is_blocking(server, req)) {
+          break;
+        }
+      }
+      started = scanned;
     }
+
+    coalesce_changes(batch, count);
+    for (size_t i = 0; i < count; i++) {
+      if (batch[i] != NULL) {
+        dispatch_request(server, client, batch[i]);
+        destroy_request(batch[i]);
+      }
     }
-    destroy_request(req);
+    // every parsed message and response tree of the batch goes at once
+    arena_reset(server->arena);
   }
+
+  arena_enter(previous);
+  return status != FRAME_INVALID;
 }
 
 void create_bind_address(struct addrinfo **bind_address, Config *config) {
@@ -220,17 +397,37 @@ void bind_and_listen(struct addrinfo *bind_address, Server *server) {
     fail("Couldn't listen to connections");
   }
 
-  // add socket to set
-  FD_ZERO(server->master_set);
-  FD_SET(server->server_socket, server->master_set);
+  server->listener.kind = WATCH_LISTENER;
+  server->listener.fd = server->server_socket;
+  server->listener.owner = server;
+  loop_add(server->loop, &server->listener, EPOLLIN | EPOLLET);
 
   log_info("Listening on %s:%d", server->config->host, server->config->port);
 }
 
 void cleanup_sockets(Server *server) {
-  for (int i = 0; i <= server->server_socket; ++i) {
-    if (FD_ISSET(i, server->master_set))
-      close(i);
+  while (server->clients) {
+    drop_client(server, server->clients);
+  }
+  if (server->server_socket >= 0) {
+    close(server->server_socket);
+  }
+}
+
+void release_idle_buffers(Timer *timer, void *arg) {
+  Server *server = arg;
+  for (Client *client = server->clients; client; client = client->next) {
+    framer_shrink(client->framer);
+  }
+}
+
+// The debounce interval has passed without changes
+void reparse_changed_sources(Timer *timer, void *arg) {
+  Server *server = arg;
+  if (server->workers) {
+    submit_task(server->workers, reparse_dirty_sources, PRIORITY_DOCUMENT_SYNC);
+  } else {
+    reparse_dirty_sources(server);
   }
 }
 
@@ -241,49 +438,153 @@ Server *create_server(Config *config) {
   server->parsed_info = calloc(1, sizeof(ParsedInfo));
   server->sources = NULL;
   server->clients = NULL;
-  server->master_set = malloc(sizeof(fd_set));
-  server->working_set = malloc(sizeof(fd_set));
+  server->blocking_input = false;
+  server->loop = create_loop();
+  server->waker = create_waker(server->loop, resume_clients, server);
+  server->arena = create_arena();
+  install_arena_hooks();
+  init_stats();
+  pthread_rwlock_init(&server->index_lock, NULL);
+  server->workers = config->threads > 0 ? create_worker_pool(server, config->threads) : NULL;
+
+  if (config->stdio) {
+    server->server_socket = -1;
+    add_stdio_client(server);
+  } else {
+    struct addrinfo *bind_address;
+    create_bind_address(&bind_address, config);
+    create_socket(bind_address, server);
+    bind_and_listen(bind_address, server);
+  }
 
-  struct addrinfo *bind_address;
-  create_bind_address(&bind_address, config);
-  create_socket(bind_address, server);
-  bind_and_listen(bind_address, server);
+  server->idle_timer = create_timer(server->loop, release_idle_buffers, server);
+  timer_start(server->idle_timer, IDLE_INTERVAL_MS, IDLE_INTERVAL_MS);
+  server->reparse_timer = create_timer(server->loop, reparse_changed_sources, server);
 
   return server;
 }
 
-void start_server(Server *server) {
+// Reads until the input is drained, the client is edge-triggered. Returns false
+// if the client has been dropped.
+bool read_client(Server *server, Client *client) {
   while (true) {
-    wait_on_clients(server);
+    if (!process_client_message(server, client)) {
+      log_error("Malformed message, closing connection");
+      drop_client(server, client);
+      return false;
+    }
+    if (!flush_output(client)) {
+      drop_client(server, client);
+      return false;
+    }
+    if (client->paused || is_waiting(client)) {
+      return true;
+    }
 
-    if (FD_ISSET(server->server_socket, server->working_set)) {
-      add_client(server);
+    char *buffer = framer_reserve(client->framer, MESSAGE_BUFFER_SIZE);
+    ssize_t bytes_received = read(client->socket, buffer, MESSAGE_BUFFER_SIZE);
+
+    if (bytes_received == 0) {
+      log_info("Client disconnected");
+      drop_client(server, client);
+      return false;
+    } else if (bytes_received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      } else if (errno != EINTR) {
+        log_error("Unexpected error: %s", strerror(errno));
+        drop_client(server, client);
+        return false;
+      }
     } else {
-      Client *client = server->clients;
-      while (client) {
-        if (FD_ISSET(client->socket, server->working_set)) {
-          if (client->received >= MESSAGE_BUFFER_SIZE) {
-            log_error("message to big, rejected");
-            client = client->next;
-            continue;
-          }
-          memset(client->request, '\0', MESSAGE_BUFFER_SIZE);
-          int bytes_received = recv(client->socket, client->request, MESSAGE_BUFFER_SIZE, 0);
-
-          if (bytes_received == 0) {
-            log_error("Unexpected disconnect");
-            drop_client(server, client);
-          } else if (bytes_received == -1) {
-            log_error("Unexpected error");
-            drop_client(server, client);
-          } else {
-            process_client_message(server, client);
-          }
+      count_stat(COUNTER_BYTES_IN, bytes_received);
+      framer_commit(client->framer, bytes_received);
+    }
+  }
+}
+
+// Picks up the messages that have been waiting for a blocking job
+void resume_clients(Waker *waker, void *arg) {
+  Server *server = arg;
+  Client *client = server->clients;
+  while (client) {
+    Client *next = client->next;
+    if (!client->paused && !is_waiting(client)) {
+      read_client(server, client);
+    }
+    client = next;
+  }
+}
+
+// Returns false if the client has been dropped
+bool write_client(Server *server, Client *client) {
+  if (!flush_output(client)) {
+    drop_client(server, client);
+    return false;
+  }
+
+  if (client->paused && pending_output(client) <= server->config->output_high_water / 2) {
+    log_info("Client output drained, resuming reads");
+    client->paused = false;
+    // edge-triggered input won't be reported again, pick it up ourselves
+    return read_client(server, client);
+  }
+  return true;
+}
+
+void start_server(Server *server) {
+  // a client closing its end must not kill us on the next write
+  signal(SIGPIPE, SIG_IGN);
+
+  if (server->blocking_input) {
+    // returns only after EOF which exits the server or when the client is paused
+    read_client(server, server->clients);
+  }
+
+  while (true) {
+    int ready = loop_wait(server->loop, -1);
+
+    for (int i = 0; i < ready; i++) {
+      struct epoll_event *event = &server->loop->events[i];
+      Watch *watch = event->data.ptr;
+
+      switch (watch->kind) {
+      case WATCH_LISTENER:
+        add_clients(server);
+        break;
+      case WATCH_TIMER:
+        timer_expired(watch->owner);
+        break;
+      case WATCH_WAKER:
+        waker_woken(watch->owner);
+        break;
+      case WATCH_CLIENT: {
+        Client *client = watch->owner;
+        bool is_input = watch == &client->watch;
+        if (event->events & EPOLLOUT && !write_client(server, client)) {
+          break;
+        }
+        if (is_input && !client->paused && !is_waiting(client) &&
+            event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          read_client(server, client);
         }
-        client = client->next;
+        break;
+      }
       }
     }
   }
 }
 
-void destroy_server(Server *server) { free(server); }
+void destroy_server(Server *server) {
+  if (server->workers) {
+    destroy_worker_pool(server->workers);
+  }
+  cleanup_sockets(server);
+  destroy_timer(server->loop, server->idle_timer);
+  destroy_timer(server->loop, server->reparse_timer);
+  destroy_waker(server->loop, server->waker);
+  destroy_loop(server->loop);
+  destroy_arena(server->arena);
+  pthread_rwlock_destroy(&server->index_lock);
+  free(server);
+}
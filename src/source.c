@@ -1,32 +1,29 @@
 #include "source.h"
+#include "json_writer.h"
 #include "stb_ds.h"
 #include "utils.h"
-#include <stdio.h>
+#include <string.h>
 
-void print_sources(Source **sources) {
-  log_info("Total sources: %d", arrlen(sources));
-  log_info("Sources info:");
-  Source *source;
-
-  for (long i = 0; i < arrlen(sources); ++i) {
-    source = sources[i];
-    printf("File path: %s\n", source->file_path);
-    printf("Content:\n%s\n", source->content);
-    printf("Root ptr: %d\n", source->root);
-    printf("Parser ptr: %d\n", source->parser);
+// Takes ownership of `content`
+Source *create_source(char *file_path, char *content) {
+  Source *source = calloc(1, sizeof(Source));
+  source->file_path = strndup(file_path, strlen(file_path));
+  char *uri = build_uri(file_path);
+  JsonWriter writer;
+  json_writer_init(&writer, strlen(uri) + 3);
+  json_write_string(&writer, uri);
+  source->uri = json_writer_finish(&writer);
+  free(uri);
+  source->content = content;
+  return source;
+}
 
-    char *opened_status;
-    switch (source->open_status) {
-    case OPENED:
-      opened_status = "OPENED";
-      break;
-    case CLOSED:
-      opened_status = "CLOSED";
-      break;
-    default:
-      opened_status = "UKNOWN";
-    }
-    printf("Open status: %s\n", opened_status);
-    printf("--------------\n");
+void print_sources(Source **sources) {
+  log_debug("Total sources: %td", arrlen(sources));
+  for (ptrdiff_t i = 0; i < arrlen(sources); ++i) {
+    Source *source = sources[i];
+    log_debug("%s (%s, %zu bytes)", source->file_path,
+              source->open_status == OPENED ? "opened" : "closed",
+              source->content ? strlen(source->content) : 0);
   }
 }
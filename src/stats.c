@@ -0,0 +1,158 @@
+#include "stats.h"
+#include "arena.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *PHASE_NAMES[] = {"frame", "parse", "handler", "serialize", "send"};
+static const char *COUNTER_NAMES[] = {"messages", "bytesIn", "bytesOut", "reparses"};
+
+// PHASE_COUNT histograms per method, then per unknown method
+static Histogram *histograms;
+static uint64_t counters[COUNTER_COUNT];
+static uint64_t started_at;
+static __thread const Method *current_method = NULL;
+
+uint64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void init_stats() {
+  histograms = calloc((method_count() + 1) * PHASE_COUNT, sizeof(Histogram));
+  if (!histograms) {
+    fail("Out of memory");
+  }
+  started_at = stats_now();
+}
+
+static Histogram *histogram(const Method *method, StatsPhase phase) {
+  size_t index = method ? method_index(method) : method_count();
+  return &histograms[index * PHASE_COUNT + phase];
+}
+
+static size_t bucket_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent >= HISTOGRAM_MAX_BITS) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  size_t sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+// Largest value that falls into the bucket
+static uint64_t bucket_limit(size_t index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+  int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS - 1;
+  uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - HISTOGRAM_SUB_BUCKET_BITS)) - 1;
+}
+
+void record_phase(const Method *method, StatsPhase phase, uint64_t nanoseconds) {
+  if (!histograms) {
+    return;
+  }
+  Histogram *h = histogram(method, phase);
+  __atomic_add_fetch(&h->counts[bucket_index(nanoseconds)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, nanoseconds, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (nanoseconds > max && !__atomic_compare_exchange_n(&h->max, &max, nanoseconds, true,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void count_stat(StatsCounter counter, uint64_t amount) {
+  __atomic_add_fetch(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+const Method *stats_enter_method(const Method *method) {
+  const Method *previous = current_method;
+  current_method = method;
+  return previous;
+}
+
+const Method *stats_current_method() { return current_method; }
+
+static double percentile(Histogram *h, uint64_t total, double fraction) {
+  uint64_t rank = (uint64_t)(fraction * total + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    if (seen >= rank) {
+      return bucket_limit(i) / 1000.0;
+    }
+  }
+  return __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000.0;
+}
+
+// Microseconds, the other threads may keep recording while it's read
+static cJSON *histogram_to_json(Histogram *h, uint64_t total) {
+  cJSON *json = cJSON_CreateObject();
+  cJSON_AddNumberToObject(json, "count", total);
+  cJSON_AddNumberToObject(json, "meanUs", __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1000.0 / total);
+  cJSON_AddNumberToObject(json, "p50Us", percentile(h, total, 0.50));
+  cJSON_AddNumberToObject(json, "p90Us", percentile(h, total, 0.90));
+  cJSON_AddNumberToObject(json, "p99Us", percentile(h, total, 0.99));
+  cJSON_AddNumberToObject(json, "maxUs", __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000.0);
+  return json;
+}
+
+// Index size is passed in, it's read under the index lock by the caller
+cJSON *stats_to_json(size_t sources, size_t constants) {
+  cJSON *json = cJSON_CreateObject();
+  cJSON_AddNumberToObject(json, "uptimeMs", (stats_now() - started_at) / 1000000);
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    cJSON_AddNumberToObject(json, COUNTER_NAMES[i], __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+  }
+  cJSON_AddNumberToObject(json, "sources", sources);
+  cJSON_AddNumberToObject(json, "constants", constants);
+
+  cJSON *methods = cJSON_CreateObject();
+  for (size_t i = 0; i <= method_count(); i++) {
+    const Method *method = i < method_count() ? method_at(i) : NULL;
+    cJSON *phases = NULL;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+      Histogram *h = histogram(method, phase);
+      uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+      if (total == 0) {
+        continue;
+      }
+      if (!phases) {
+        phases = cJSON_CreateObject();
+        cJSON_AddItemToObject(methods, method ? method->name : "(unknown)", phases);
+      }
+      cJSON_AddItemToObject(phases, PHASE_NAMES[phase], histogram_to_json(h, total));
+    }
+  }
+  cJSON_AddItemToObject(json, "methods", methods);
+  return json;
+}
+
+void dump_stats(const char *file_path, size_t sources, size_t constants) {
+  FILE *file = fopen(file_path, "w");
+  if (!file) {
+    log_error("Couldn't write stats to `%s`: %s", file_path, strerror(errno));
+    return;
+  }
+  Arena *arena = arena_enter(NULL);
+  cJSON *json = stats_to_json(sources, constants);
+  char *printed = cJSON_Print(json);
+  fprintf(file, "%s\n", printed);
+  fclose(file);
+  cJSON_free(printed);
+  cJSON_Delete(json);
+  arena_enter(arena);
+}
@@ -0,0 +1,158 @@
+#include "trace.h"
+#include "json_writer.h"
+#include "stats.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+  const char *name;
+  char detail[TRACE_DETAIL_SIZE];
+  uint64_t start;
+  uint64_t duration;
+} Span;
+
+// The lock is only contended when stop_tracing writes out a buffer its
+// thread is still filling
+typedef struct TraceBuffer TraceBuffer;
+struct TraceBuffer {
+  pthread_mutex_t lock;
+  pid_t tid;
+  size_t length;
+  Span spans[TRACE_BUFFER_SPANS];
+  TraceBuffer *next;
+};
+
+static bool tracing;
+static FILE *output;
+static uint64_t started_at;
+static bool first_event = true;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER; // also guards `buffers`
+static TraceBuffer *buffers;
+static __thread TraceBuffer *thread_buffer = NULL;
+
+// The array form of the format, viewers accept it without the closing bracket
+// in case the server dies before stop_tracing
+void start_tracing(const char *file_path) {
+  output = fopen(file_path, "w");
+  if (!output) {
+    log_error("Couldn't open trace file `%s`: %s", file_path, strerror(errno));
+    return;
+  }
+  fputs("[\n", output);
+  started_at = stats_now();
+  __atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
+  atexit(stop_tracing);
+}
+
+uint64_t trace_begin() { return __atomic_load_n(&tracing, __ATOMIC_RELAXED) ? stats_now() : 0; }
+
+static TraceBuffer *current_buffer() {
+  if (thread_buffer) {
+    return thread_buffer;
+  }
+  TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+  if (!buffer) {
+    fail("Out of memory");
+  }
+  pthread_mutex_init(&buffer->lock, NULL);
+  buffer->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&output_lock);
+  buffer->next = buffers;
+  buffers = buffer;
+  pthread_mutex_unlock(&output_lock);
+  thread_buffer = buffer;
+  return buffer;
+}
+
+// Complete ("X") events, timestamps are microseconds since start_tracing.
+// Called with the buffer lock held, the events are written out after it's
+// released: the output lock is never taken under a buffer lock.
+static void format_spans(TraceBuffer *buffer, JsonWriter *writer) {
+  json_writer_init(writer, buffer->length * 128);
+  for (size_t i = 0; i < buffer->length; i++) {
+    Span *span = &buffer->spans[i];
+    if (i > 0) {
+      json_write_literal(writer, ",\n");
+    }
+    json_write_literal(writer, "{\"ph\":\"X\",\"pid\":1,\"tid\":");
+    json_write_number(writer, buffer->tid);
+    json_write_literal(writer, ",\"name\":");
+    json_write_string(writer, span->name);
+    json_write_literal(writer, ",\"ts\":");
+    json_write_number(writer, (span->start - started_at) / 1000);
+    json_write_literal(writer, ",\"dur\":");
+    json_write_number(writer, span->duration / 1000);
+    if (span->detail[0]) {
+      json_write_literal(writer, ",\"args\":{\"detail\":");
+      json_write_string(writer, span->detail);
+      json_write_literal(writer, "}");
+    }
+    json_write_literal(writer, "}");
+  }
+  buffer->length = 0;
+}
+
+// Called with the output lock held, the file is gone once stop_tracing ran
+static void write_events(JsonWriter *writer) {
+  if (output && writer->length > 0) {
+    if (!first_event) {
+      fputs(",\n", output);
+    }
+    first_event = false;
+    fwrite(writer->data, 1, writer->length, output);
+  }
+  free(writer->data);
+}
+
+void trace_end(const char *name, const char *detail, uint64_t started) {
+  if (started == 0 || !__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  uint64_t now = stats_now();
+  TraceBuffer *buffer = current_buffer();
+  pthread_mutex_lock(&buffer->lock);
+  Span *span = &buffer->spans[buffer->length++];
+  span->name = name;
+  span->start = started;
+  span->duration = now - started;
+  span->detail[0] = '\0';
+  if (detail) {
+    strncat(span->detail, detail, TRACE_DETAIL_SIZE - 1);
+  }
+  bool full = buffer->length == TRACE_BUFFER_SPANS;
+  JsonWriter writer;
+  if (full) {
+    format_spans(buffer, &writer);
+  }
+  pthread_mutex_unlock(&buffer->lock);
+
+  if (full) {
+    pthread_mutex_lock(&output_lock);
+    write_events(&writer);
+    pthread_mutex_unlock(&output_lock);
+  }
+}
+
+void stop_tracing() {
+  if (!__atomic_exchange_n(&tracing, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  pthread_mutex_lock(&output_lock);
+  for (TraceBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+    JsonWriter writer;
+    pthread_mutex_lock(&buffer->lock);
+    format_spans(buffer, &writer);
+    pthread_mutex_unlock(&buffer->lock);
+    write_events(&writer);
+  }
+  fputs("\n]\n", output);
+  fclose(output);
+  output = NULL;
+  pthread_mutex_unlock(&output_lock);
+}
@@ -1,48 +1,75 @@
 #include "transport.h"
+#include "arena.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-Headers *create_headers(char *headers_str) {
-  Headers *headers = malloc(sizeof(Headers));
-  char *separator = "\r\n";
+static char *find_header_value(char *line, char *line_end, const char *name) {
+  size_t name_length = strlen(name);
+  if ((size_t)(line_end - line) <= name_length || line[name_length] != ':' ||
+      strncasecmp(line, name, name_length) != 0) {
+    return NULL;
+  }
+
+  char *value = line + name_length + 1;
+  while (value < line_end && isspace(*value))
+    value++;
+  return value;
+}
 
-  char *tail = strstr(headers_str, separator);
-  char buff[strlen(headers_str)];
+static size_t trimmed_length(char *str, char *end) {
+  while (end > str && isspace(*(end - 1)))
+    end--;
+  return end - str;
+}
 
-  while (tail != NULL) {
-    strncpy(buff, headers_str, tail - headers_str);
-    buff[tail - headers_str] = '\0';
-    char *header_name = strtok(buff, ":");
+Headers *create_headers(char *headers_str, size_t length) {
+  Headers *headers = calloc(1, sizeof(Headers));
+  char *end = headers_str + length;
+  char *line = headers_str;
 
-    if (strcasecmp(header_name, "Content-Length") == 0) {
-      size_t content_length = atoi(trim(strtok(NULL, ":")));
-      headers->content_length = malloc(sizeof(size_t));
-      *headers->content_length = content_length;
-    } else if (strcasecmp(header_name, "Content-Type") == 0) {
-      char *header_value = strtok(NULL, ":");
+  while (line < end) {
+    char *line_end = memchr(line, '\r', end - line);
+    if (line_end == NULL) {
+      line_end = end;
+    }
 
-      char *content_type = trim(strtok(header_value, ";"));
-      headers->content_type = strdup(content_type);
+    char *value;
+    if ((value = find_header_value(line, line_end, "Content-Length")) != NULL) {
+      size_t content_length = 0;
+      char *c = value;
+      while (c < line_end && isdigit(*c)) {
+        content_length = content_length * 10 + (*c - '0');
+        if (content_length > MAX_CONTENT_LENGTH)
+          break;
+        c++;
+      }
+      headers->has_content_length = c > value && trimmed_length(c, line_end) == 0;
+      headers->content_length = content_length;
+    } else if ((value = find_header_value(line, line_end, "Content-Type")) != NULL) {
+      char *separator = memchr(value, ';', line_end - value);
+      char *content_type_end = separator ? separator : line_end;
+      headers->content_type = strndup(value, trimmed_length(value, content_type_end));
 
-      char *charset_kv = strtok(NULL, ";");
-      char *charset;
-      if (charset_kv == NULL) {
-        charset = DEFAULT_CHARSET;
-      } else {
-        strtok(charset_kv, "=");
-        charset = strtok(NULL, "=");
-        if (charset == NULL) {
-          charset = DEFAULT_CHARSET;
+      if (separator != NULL) {
+        char *charset = separator + 1;
+        while (charset < line_end && isspace(*charset))
+          charset++;
+        if (line_end - charset > 8 && strncasecmp(charset, "charset=", 8) == 0) {
+          charset += 8;
+          headers->charset = strndup(charset, trimmed_length(charset, line_end));
         }
       }
-      headers->charset = strdup(charset);
     }
-    headers_str = tail + strlen(separator);
-    tail = strstr(headers_str, "\r\n");
+    line = line_end + 2;
   }
   if (headers->charset == NULL) {
     headers->charset = strdup(DEFAULT_CHARSET);
@@ -51,102 +78,450 @@ Headers *create_headers(char *headers_str) {
   return headers;
 }
 
-Request *create_request(char *request) {
-  char *content_separator = "\r\n\r\n";
-  char *tail;
-
-  tail = strstr(request, content_separator);
-  if (tail == NULL) {
-    log_error("Invalid message");
+// Copies the method name next to the request. Names are short and almost
+// never escaped, so they're copied as is when possible.
+static char *scan_method(JsonSpan value) {
+  if (!json_is_string(value)) {
     return NULL;
   }
-  size_t headers_len = tail - request + 2;
-  size_t body_len = strlen(request) - headers_len;
+  const char *name = value.start + 1;
+  size_t length = value.length - 2;
+  char *unescaped = NULL;
+  if (memchr(name, '\\', length) != NULL) {
+    if ((unescaped = json_string_dup(value)) == NULL) {
+      return NULL;
+    }
+    name = unescaped;
+    length = strlen(unescaped);
+  }
 
-  char headers_str[headers_len];
-  char body_str[body_len];
+  char *method = cJSON_malloc(length + 1);
+  memcpy(method, name, length);
+  method[length] = '\0';
+  free(unescaped);
+  return method;
+}
 
-  strncpy(headers_str, request, headers_len);
-  strncpy(body_str, request + headers_len, body_len);
-  printf("request body %s\n", body_str);
+// Pulls `id`, `method` and the span of `params` out of the message in a single
+// pass, without building a tree. Params are parsed later, only for messages
+// that actually get handled.
+static bool scan_envelope(Request *req, char *body_str, size_t body_len) {
+  JsonSpan body = {body_str, body_len};
+  JsonCursor cursor;
+  JsonSpan key, value;
 
-  Headers *headers = create_headers(headers_str);
-  log_info("Content type: %s", headers->content_type);
-  log_info("Charset: %s", headers->charset);
-  log_info("Content length: %zu", *headers->content_length);
+  if (!json_enter(body, &cursor)) {
+    return false;
+  }
+  while (json_next_member(&cursor, &key, &value)) {
+    if (json_key_equals(key, "id")) {
+      req->has_id = *value.start != 'n'; // null
+      if (*value.start == '-' || isdigit((unsigned char)*value.start)) {
+        req->id = strtol(value.start, NULL, 10);
+      }
+    } else if (json_key_equals(key, "method")) {
+      if ((req->method = scan_method(value)) == NULL) {
+        return false;
+      }
+    } else if (json_key_equals(key, "params")) {
+      req->raw_params = value;
+    }
+  }
+  return true;
+}
 
-  if (strcasecmp(headers->charset, DEFAULT_CHARSET) != 0) {
+Request *create_request(Headers *headers, char *body_str, size_t body_len) {
+  log_debug("Content type: %s", headers->content_type);
+  log_debug("Charset: %s", headers->charset);
+  log_debug("Content length: %zu", headers->content_length);
+
+  if (strcasecmp(headers->charset, DEFAULT_CHARSET) != 0 &&
+      strcasecmp(headers->charset, "utf8") != 0) {
     log_error("Unsupported charset: %s. Tool supports utf-8 only\n", headers->charset);
     destroy_headers(headers);
     return NULL;
   }
-  cJSON *body = cJSON_Parse(body_str);
-  if (body == NULL) {
-    const char *error_ptr = cJSON_GetErrorPtr();
-    if (error_ptr != NULL) {
-      log_error("Invalid JSON at: %s", error_ptr);
-      destroy_headers(headers);
-      cJSON_Delete(body);
+
+  // allocated in the request arena if there is one
+  Request *req = cJSON_malloc(sizeof(Request));
+  memset(req, 0, sizeof(Request));
+  req->headers = headers;
+
+  if (!scan_envelope(req, body_str, body_len)) {
+    log_error("Invalid JSON message");
+    destroy_request(req);
+    return NULL;
+  }
+
+  if (req->method == NULL) {
+    // the client answering a request of ours, like window/workDoneProgress/create
+    if (req->has_id) {
+      log_debug("Client response dropped");
+      destroy_request(req);
       return NULL;
     }
+    log_error("Message without method");
+    destroy_request(req);
+    return NULL;
   }
 
-  Request *req = malloc(sizeof(Request));
-  req->headers = headers;
+  return req;
+}
+
+cJSON *request_params(Request *req) {
+  if (req->body == NULL && req->raw_params.length > 0) {
+    uint64_t traced = trace_begin();
+    uint64_t started = stats_now();
+    req->body = cJSON_ParseWithLength(req->raw_params.start, req->raw_params.length);
+    req->parse_time += stats_now() - started;
+    trace_end("parse_params", req->method, traced);
+    if (req->body == NULL) {
+      log_error("Invalid JSON in params of `%s`", req->method);
+    } else if (cJSON_IsObject(req->body)) {
+      req->params = req->body;
+    }
+  }
+  return req->params;
+}
 
-  cJSON *id = cJSON_GetObjectItem(body, "id");
-  if (cJSON_IsNumber(id)) {
-    req->id = id->valueint;
+Framer *create_framer() {
+  Framer *framer = calloc(1, sizeof(Framer));
+  if (!framer) {
+    fail("Out of memory");
   }
+  return framer;
+}
 
-  cJSON *method = cJSON_GetObjectItem(body, "method");
-  if (cJSON_IsString(method) && (method->valuestring != NULL)) {
-    req->method = strdup(method->valuestring);
+char *framer_reserve(Framer *framer, size_t size) {
+  // drop already handled messages before growing
+  if (framer->start > 0) {
+    size_t pending = framer->length - framer->start;
+    if (pending > 0) {
+      memmove(framer->data, framer->data + framer->start, pending);
+    }
+    framer->length = pending;
+    framer->scanned -= framer->start;
+    framer->body_start -= framer->headers ? framer->start : 0;
+    framer->start = 0;
   }
 
-  cJSON *params = cJSON_GetObjectItem(body, "params");
-  if (cJSON_IsObject(params)) {
-    req->params = cJSON_Duplicate(params, true);
+  size_t required = framer->length + size;
+  if (framer->headers != NULL &&
+      framer->body_start + framer->headers->content_length > required) {
+    // the whole body is announced already, grow once instead of doubling up to it
+    required = framer->body_start + framer->headers->content_length;
   }
 
-  return req;
+  if (required > framer->capacity) {
+    size_t capacity = framer->capacity ? framer->capacity : MESSAGE_BUFFER_SIZE;
+    while (capacity < required)
+      capacity *= 2;
+
+    char *data = realloc(framer->data, capacity);
+    if (!data) {
+      fail("Out of memory");
+    }
+    framer->data = data;
+    framer->capacity = capacity;
+  }
+
+  return framer->data + framer->length;
 }
 
-void send_response(int socket, int status, char *body) {
-  size_t content_length = strlen(body);
-  char *template = "HTTP/1.1 %d %s\r\nContent-Length: %d\r\nContent-Type: "
-                   "application/vscode-jsonrpc; charset=utf-8\r\n\r\n\%s\n";
-  char *status_msg;
-  switch (status) {
-  case 200:
-    status_msg = "OK";
-    break;
-  case 204:
-    status_msg = "No Content";
-    break;
-  default:
-    log_error("Unsupported status %d", status);
+void framer_commit(Framer *framer, size_t size) { framer->length += size; }
+
+static bool framer_parse_headers(Framer *framer, FrameStatus *status) {
+  char *begin = framer->data + framer->start;
+  char *end = framer->data + framer->length;
+  // the separator may be split across reads, rescan its first bytes
+  size_t offset = framer->scanned > framer->start + 3 ? framer->scanned - 3 : framer->start;
+  char *c = framer->data + offset;
+
+  while ((c = memchr(c, '\r', end - c)) != NULL) {
+    if (end - c < 4)
+      break;
+    if (memcmp(c, "\r\n\r\n", 4) == 0) {
+      framer->headers = create_headers(begin, c - begin);
+      framer->body_start = c + 4 - framer->data;
+      if (!framer->headers->has_content_length) {
+        log_error("Message without valid Content-Length header");
+        *status = FRAME_INVALID;
+        return false;
+      }
+      return true;
+    }
+    c++;
+  }
+
+  framer->scanned = framer->length;
+  if (framer->length - framer->start > MAX_HEADERS_SIZE) {
+    log_error("Message headers are too big");
+    *status = FRAME_INVALID;
+  }
+  return false;
+}
+
+FrameStatus framer_next(Framer *framer, Frame *frame) {
+  FrameStatus status = FRAME_INCOMPLETE;
+
+  if (framer->length == framer->start) {
+    return FRAME_INCOMPLETE;
+  }
+
+  if (framer->headers == NULL && !framer_parse_headers(framer, &status)) {
+    return status;
+  }
+
+  size_t content_length = framer->headers->content_length;
+  if (framer->length - framer->body_start < content_length) {
+    return FRAME_INCOMPLETE;
+  }
+
+  frame->headers = framer->headers;
+  frame->body = framer->data + framer->body_start;
+  frame->body_length = content_length;
+
+  framer->start = framer->body_start + content_length;
+  framer->scanned = framer->start;
+  framer->headers = NULL;
+  if (framer->start == framer->length) {
+    // everything is consumed, next read starts from the beginning
+    framer->start = framer->length = framer->scanned = 0;
+  }
+
+  return FRAME_READY;
+}
+
+// Gives back memory of an idle framer, e.g. after a huge didOpen
+void framer_shrink(Framer *framer) {
+  if (framer->length == 0 && framer->capacity > MESSAGE_BUFFER_SIZE) {
+    free(framer->data);
+    framer->data = NULL;
+    framer->capacity = 0;
+  }
+}
+
+void destroy_framer(Framer *framer) {
+  if (framer->headers != NULL) {
+    destroy_headers(framer->headers);
+  }
+  free(framer->data);
+  free(framer);
+}
+
+Client *create_client() {
+  static unsigned next_id = 1;
+  Client *client = (Client *)calloc(1, sizeof(Client));
+  if (!client) {
+    fail("Out of memory");
+  }
+  client->id = next_id++;
+  client->address_length = sizeof(client->address);
+  client->watch.kind = WATCH_CLIENT;
+  client->watch.owner = client;
+  client->output_watch.kind = WATCH_CLIENT;
+  client->output_watch.owner = client;
+  client->framer = create_framer();
+  client->refs = 1;
+  pthread_mutex_init(&client->output_lock, NULL);
+  return client;
+}
+
+void retain_client(Client *client) { __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED); }
+
+void release_client(Client *client) {
+  if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) > 0) {
     return;
   }
+  destroy_framer(client->framer);
+  discard_output(client);
+  pthread_mutex_destroy(&client->output_lock);
+  free(client);
+}
 
-  char response_message[MESSAGE_BUFFER_SIZE] = {'\0'};
-  int msg_len = snprintf(response_message, MESSAGE_BUFFER_SIZE, template, status, status_msg,
-                         content_length, body);
-  if (send(socket, response_message, msg_len, 0) < 0) {
-    log_error("Couldn't send response because of %s", strerror(errno));
+static void discard_frames(Client *client);
+
+// Stops sending to the client before its descriptors are closed, responses
+// that workers queue afterwards are discarded
+void close_client(Client *client) {
+  pthread_mutex_lock(&client->output_lock);
+  client->closed = true;
+  discard_frames(client);
+  pthread_mutex_unlock(&client->output_lock);
+}
+
+size_t pending_output(Client *client) {
+  pthread_mutex_lock(&client->output_lock);
+  size_t bytes = client->output_bytes;
+  pthread_mutex_unlock(&client->output_lock);
+  return bytes;
+}
+
+// Queues the response, it's written when the server flushes the client or
+// the descriptor becomes writable. Takes ownership of `body` which must be
+// allocated with malloc.
+void send_response(Client *client, char *body) {
+  pthread_mutex_lock(&client->output_lock);
+  if (client->closed) {
+    pthread_mutex_unlock(&client->output_lock);
+    free(body);
+    return;
+  }
+
+  OutFrame *frame = malloc(sizeof(OutFrame));
+  if (!frame) {
+    fail("Out of memory");
+  }
+  frame->body = body;
+  frame->body_length = strlen(body);
+  frame->written = 0;
+  frame->queued_at = stats_now();
+  frame->method = stats_current_method();
+  frame->next = NULL;
+  frame->header_length = snprintf(frame->header, RESPONSE_HEADER_SIZE,
+                                  "Content-Length: %zu\r\nContent-Type: "
+                                  "application/vscode-jsonrpc; charset=utf-8\r\n\r\n",
+                                  frame->body_length);
+
+  if (client->output_tail) {
+    client->output_tail->next = frame;
+  } else {
+    client->output_head = frame;
   }
+  client->output_tail = frame;
+  client->output_bytes += frame->header_length + frame->body_length;
+  pthread_mutex_unlock(&client->output_lock);
+}
+
+// Prints the response outside of the request arena, the queued body has to
+// outlive the cycle
+void send_json(Client *client, cJSON *json) {
+  uint64_t started = stats_now();
+  Arena *arena = arena_enter(NULL);
+  char *body = cJSON_PrintUnformatted(json);
+  arena_enter(arena);
+  record_phase(stats_current_method(), PHASE_SERIALIZE, stats_now() - started);
+  trace_end("serialize", NULL, started);
+  send_response(client, body);
+}
+
+static void pop_output(Client *client) {
+  OutFrame *frame = client->output_head;
+  client->output_head = frame->next;
+  if (client->output_head == NULL) {
+    client->output_tail = NULL;
+  }
+  free(frame->body);
+  free(frame);
+}
+
+static bool write_frames(Client *client) {
+  struct iovec iov[MAX_WRITE_BATCH];
+
+  while (client->output_head) {
+    int count = 0;
+    for (OutFrame *frame = client->output_head; frame && count + 2 <= MAX_WRITE_BATCH;
+         frame = frame->next) {
+      if (frame->written < frame->header_length) {
+        iov[count].iov_base = frame->header + frame->written;
+        iov[count].iov_len = frame->header_length - frame->written;
+        count++;
+        iov[count].iov_base = frame->body;
+        iov[count].iov_len = frame->body_length;
+      } else {
+        size_t body_written = frame->written - frame->header_length;
+        iov[count].iov_base = frame->body + body_written;
+        iov[count].iov_len = frame->body_length - body_written;
+      }
+      count++;
+    }
+
+    ssize_t written = writev(client->output, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the rest goes out when the descriptor becomes writable
+        return true;
+      }
+      log_error("Couldn't send response because of %s", strerror(errno));
+      return false;
+    }
+
+    size_t left = written;
+    client->output_bytes -= written;
+    count_stat(COUNTER_BYTES_OUT, written);
+    while (left > 0) {
+      OutFrame *frame = client->output_head;
+      size_t frame_left = frame->header_length + frame->body_length - frame->written;
+      if (left < frame_left) {
+        frame->written += left;
+        break;
+      }
+      left -= frame_left;
+      record_phase(frame->method, PHASE_SEND, stats_now() - frame->queued_at);
+      pop_output(client);
+    }
+  }
+
+  return true;
+}
+
+// Writes as much of the queued output as the descriptor accepts. Returns false
+// if the connection is broken.
+bool flush_output(Client *client) {
+  pthread_mutex_lock(&client->output_lock);
+  bool result = client->closed || write_frames(client);
+  pthread_mutex_unlock(&client->output_lock);
+  return result;
+}
+
+static void discard_frames(Client *client) {
+  while (client->output_head) {
+    pop_output(client);
+  }
+  client->output_bytes = 0;
+}
+
+void discard_output(Client *client) {
+  pthread_mutex_lock(&client->output_lock);
+  discard_frames(client);
+  pthread_mutex_unlock(&client->output_lock);
 }
 
 void destroy_headers(Headers *headers) {
   free(headers->content_type);
   free(headers->charset);
-  free(headers->content_length);
   free(headers);
 }
 
+// Copies the request out of the framer buffer and the request arena, so that
+// it can be handled on another thread. Params aren't parsed yet, only their
+// bytes are copied. The headers move to the copy.
+Request *detach_request(Request *req) {
+  Request *detached = malloc(sizeof(Request));
+  if (!detached) {
+    fail("Out of memory");
+  }
+  *detached = *req;
+  detached->method = strdup(req->method);
+  detached->message = malloc(req->raw_params.length + 1);
+  if (!detached->method || !detached->message) {
+    fail("Out of memory");
+  }
+  memcpy(detached->message, req->raw_params.start, req->raw_params.length);
+  detached->raw_params.start = detached->message;
+
+  req->headers = NULL;
+  return detached;
+}
+
 void destroy_request(Request *req) {
-  destroy_headers(req->headers);
-  free(req->method);
-  cJSON_free(req->params);
-  free(req);
+  if (req->headers) {
+    destroy_headers(req->headers);
+  }
+  cJSON_Delete(req->body);
+  cJSON_free(req->method);
+  free(req->message);
+  cJSON_free(req);
 }
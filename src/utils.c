@@ -2,7 +2,6 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,11 +42,11 @@ bool is_starts_with(char *left, char *right) {
   return true;
 }
 
-bool is_includes(const char **arr, char *str) {
+bool is_includes(const char **arr, size_t length, char *str) {
   if (arr == NULL || str == NULL)
     return false;
 
-  for (size_t i = 0; i < sizeof(arr) / sizeof(arr[0]); ++i) {
+  for (size_t i = 0; i < length; ++i) {
     if (strcmp(arr[i], str) == 0)
       return true;
   }
@@ -110,29 +109,12 @@ char *file_name(char *file_path) {
   }
 }
 
+// The logger writes what's queued before the process exits
 void fail(char *msg) {
-  fprintf(stderr, "[ERROR] %s: %s\n", msg, strerror(errno));
+  log_error("%s: %s", msg, strerror(errno));
   exit(EXIT_FAILURE);
 }
 
-void log_info(char *msg, ...) {
-  va_list args;
-  printf("[INFO] ");
-  va_start(args, msg);
-  vprintf(msg, args);
-  printf("\n");
-  va_end(args);
-}
-
-void log_error(char *msg, ...) {
-  va_list args;
-  printf("[ERROR] ");
-  va_start(args, msg);
-  vprintf(msg, args);
-  printf("\n");
-  va_end(args);
-}
-
 // File utils
 bool is_dir(char *file_path) {
   int fd = open(file_path, O_RDONLY, 0);
@@ -169,8 +151,13 @@ char *build_uri(char *file_path) {
   return concat_strings("file://", file_path);
 }
 
+// NULL if the file can't be opened
 char *readall(char *file_path) {
   FILE *f = fopen(file_path, "rb");
+  if (!f) {
+    log_error("Couldn't read `%s`: %s", file_path, strerror(errno));
+    return NULL;
+  }
   fseek(f, 0, SEEK_END);
   long fsize = ftell(f);
   fseek(f, 0, SEEK_SET); /* same as rewind(f); */
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "walker.h"
+#include "stb_ds.h"
+#include "trace.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Large enough for a few hundred entries per syscall
+#define DENTS_BUFFER_SIZE (64 * 1024)
+
+// The kernel's record, glibc only declares it from 2.30
+typedef struct {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} Dirent64;
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} DirId;
+
+typedef struct {
+  DirId key;
+  bool value;
+} VisitedHM;
+
+typedef struct {
+  char *path;
+  void *state; // from open_dir of the parent
+} WalkDir;
+
+typedef struct {
+  const WalkFilter *filter;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // a directory was queued or the last one was read
+  WalkDir *dirs;          // directories waiting to be read
+  size_t busy;            // threads reading a directory
+  VisitedHM *visited;
+  WalkFile *files;
+} Walk;
+
+static bool is_dot_or_dotdot(const char *name) {
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static char *join_path(const char *dir_path, size_t dir_length, const char *name) {
+  size_t name_length = strlen(name);
+  bool slash = dir_length > 0 && dir_path[dir_length - 1] != '/';
+  char *path = malloc(dir_length + slash + name_length + 1);
+  if (!path) {
+    fail("Out of memory");
+  }
+  memcpy(path, dir_path, dir_length);
+  if (slash) {
+    path[dir_length] = '/';
+  }
+  memcpy(path + dir_length + slash, name, name_length + 1);
+  return path;
+}
+
+// False if the directory was already read, links can point back up the tree
+static bool mark_visited(Walk *walk, int fd) {
+  struct stat dir_stat;
+  if (fstat(fd, &dir_stat) != 0) {
+    return false;
+  }
+  DirId id;
+  memset(&id, 0, sizeof(id));
+  id.dev = dir_stat.st_dev;
+  id.ino = dir_stat.st_ino;
+
+  pthread_mutex_lock(&walk->lock);
+  bool first = hmgeti(walk->visited, id) < 0;
+  if (first) {
+    hmput(walk->visited, id, true);
+  }
+  pthread_mutex_unlock(&walk->lock);
+  return first;
+}
+
+static void read_dir(Walk *walk, WalkDir *dir, char *buffer, WalkFile **files,
+                     WalkDir **subdirs) {
+  const WalkFilter *filter = walk->filter;
+  const char *dir_path = dir->path;
+  uint64_t started = trace_begin();
+  int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    log_error("Error while reading `%s` because of error: '%s'", dir_path, strerror(errno));
+    return;
+  }
+  if (!mark_visited(walk, fd)) {
+    close(fd);
+    return;
+  }
+  void *state = filter->open_dir ? filter->open_dir(filter->arg, dir->state, fd, dir_path)
+                                 : dir->state;
+
+  size_t dir_length = strlen(dir_path);
+  long length;
+  while ((length = syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER_SIZE)) > 0) {
+    for (long offset = 0; offset < length;) {
+      Dirent64 *entry = (Dirent64 *)(buffer + offset);
+      offset += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (is_dot_or_dotdot(name)) {
+        continue;
+      }
+
+      unsigned char type = entry->d_type;
+      struct statx entry_stat;
+      bool has_size = false;
+      if (type == DT_UNKNOWN || type == DT_LNK) {
+        // some filesystems leave d_type out, links are followed
+        if (!filter->accept(filter->arg, state, dir_path, name, true) &&
+            !filter->accept(filter->arg, state, dir_path, name, false)) {
+          continue;
+        }
+        if (statx(fd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &entry_stat) != 0) {
+          continue; // dangling link or gone since
+        }
+        type = S_ISDIR(entry_stat.stx_mode) ? DT_DIR : S_ISREG(entry_stat.stx_mode) ? DT_REG : 0;
+        has_size = true;
+      }
+
+      if (type == DT_DIR && filter->accept(filter->arg, state, dir_path, name, true)) {
+        WalkDir subdir = {.path = join_path(dir_path, dir_length, name), .state = state};
+        arrput(*subdirs, subdir);
+      } else if (type == DT_REG && filter->accept(filter->arg, state, dir_path, name, false)) {
+        if (!has_size && statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_SIZE,
+                               &entry_stat) != 0) {
+          entry_stat.stx_size = 0;
+        }
+        WalkFile file = {.path = join_path(dir_path, dir_length, name),
+                         .size = entry_stat.stx_size};
+        arrput(*files, file);
+      }
+    }
+  }
+  if (length < 0) {
+    log_error("Error while reading `%s` because of error: '%s'", dir_path, strerror(errno));
+  }
+  close(fd);
+  trace_end("walk_dir", dir_path, started);
+}
+
+// Files are collected per thread and handed over once the walk is done
+static void *run_walker(void *arg) {
+  Walk *walk = arg;
+  char *buffer = malloc(DENTS_BUFFER_SIZE);
+  if (!buffer) {
+    fail("Out of memory");
+  }
+  WalkFile *files = NULL;
+  WalkDir *subdirs = NULL;
+
+  pthread_mutex_lock(&walk->lock);
+  while (true) {
+    while (arrlen(walk->dirs) == 0 && walk->busy > 0) {
+      pthread_cond_wait(&walk->changed, &walk->lock);
+    }
+    if (arrlen(walk->dirs) == 0) {
+      break;
+    }
+    WalkDir dir = arrpop(walk->dirs);
+    walk->busy++;
+    pthread_mutex_unlock(&walk->lock);
+
+    read_dir(walk, &dir, buffer, &files, &subdirs);
+    free(dir.path);
+
+    pthread_mutex_lock(&walk->lock);
+    for (size_t i = 0; i < arrlenu(subdirs); i++) {
+      arrput(walk->dirs, subdirs[i]);
+    }
+    walk->busy--;
+    if (arrlen(subdirs) > 0 || walk->busy == 0) {
+      pthread_cond_broadcast(&walk->changed);
+    }
+    arrfree(subdirs);
+  }
+  for (size_t i = 0; i < arrlenu(files); i++) {
+    arrput(walk->files, files[i]);
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  arrfree(files);
+  arrfree(subdirs);
+  free(buffer);
+  return NULL;
+}
+
+WalkFile *walk_tree(const char *root_path, size_t thread_count, const WalkFilter *filter) {
+  uint64_t started = trace_begin();
+  Walk walk = {.filter = filter};
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.changed, NULL);
+  WalkDir root = {.path = strdup(root_path)};
+  arrput(walk.dirs, root);
+
+  // the calling thread walks too
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  size_t started_threads = 0;
+  for (size_t i = 1; i < thread_count; i++) {
+    if (pthread_create(&threads[started_threads], NULL, run_walker, &walk) != 0) {
+      log_error("Couldn't start walker thread: %s", strerror(errno));
+      break;
+    }
+    started_threads++;
+  }
+  run_walker(&walk);
+  for (size_t i = 0; i < started_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  arrfree(walk.dirs);
+  hmfree(walk.visited);
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.changed);
+  trace_end("walk_tree", root_path, started);
+  return walk.files;
+}
@@ -0,0 +1,299 @@
+#include "workers.h"
+#include "json_scan.h"
+#include "stb_ds.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// keys of document strands are 32-bit hashes, internal tasks share one above
+#define TASK_KEY (1ull << 32)
+
+static void destroy_job(Job *job) {
+  if (job->pending) {
+    unregister_request(job->pending);
+  }
+  if (job->request) {
+    destroy_request(job->request);
+    release_client(job->client);
+  }
+  free(job);
+}
+
+static void run_job(Server *server, Job *job) {
+  if (job->task) {
+    job->task(server);
+    free(job);
+    return;
+  }
+
+  PendingRequest *outer = enter_request(job->pending);
+  if (is_request_cancelled()) {
+    // cancelled while it was queued
+    request_cancelled(job->client, job->request);
+  } else {
+    call_method(job->method, server, job->client, job->request);
+  }
+  enter_request(outer);
+  if (job->pending) {
+    unregister_request(job->pending);
+  }
+  destroy_request(job->request);
+  // a broken connection is noticed and dropped by the I/O thread
+  flush_output(job->client);
+  if (job->method->thread == ON_WORKER_BLOCKING) {
+    __atomic_store_n(&job->client->waiting, false, __ATOMIC_RELEASE);
+    wake(server->waker);
+  }
+  release_client(job->client);
+  free(job);
+}
+
+// All of the scheduling below is done with the pool locked
+
+static void make_ready(WorkerPool *pool, Strand *strand) {
+  MethodPriority priority = strand->head->priority;
+  strand->next = NULL;
+  if (pool->queue_tails[priority]) {
+    pool->queue_tails[priority]->next = strand;
+  } else {
+    pool->queue_heads[priority] = strand;
+  }
+  pool->queue_tails[priority] = strand;
+  pthread_cond_signal(&pool->ready);
+}
+
+// Takes the next job of the highest ready priority, its strand is running
+// until finish_job
+static Job *take_job(WorkerPool *pool, Strand **strand_out) {
+  for (int priority = PRIORITY_INTERACTIVE; priority < PRIORITY_CLASSES; priority++) {
+    Strand *strand = pool->queue_heads[priority];
+    if (strand == NULL) {
+      continue;
+    }
+    pool->queue_heads[priority] = strand->next;
+    if (pool->queue_heads[priority] == NULL) {
+      pool->queue_tails[priority] = NULL;
+    }
+
+    Job *job = strand->head;
+    strand->head = job->next;
+    if (strand->head == NULL) {
+      strand->tail = NULL;
+    }
+    strand->running = true;
+    pool->running[priority]++;
+    *strand_out = strand;
+    return job;
+  }
+  return NULL;
+}
+
+static bool has_foreground_work(WorkerPool *pool) {
+  for (int priority = PRIORITY_INTERACTIVE; priority < PRIORITY_BACKGROUND; priority++) {
+    if (pool->queue_heads[priority] || pool->running[priority] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void finish_job(WorkerPool *pool, Strand *strand, MethodPriority priority) {
+  strand->running = false;
+  pool->running[priority]--;
+  if (strand->head) {
+    make_ready(pool, strand);
+  } else {
+    hmdel(pool->strands, strand->key);
+    free(strand);
+  }
+  if (--pool->unfinished == 0) {
+    pthread_cond_broadcast(&pool->idle);
+  }
+  if (priority < PRIORITY_BACKGROUND && !has_foreground_work(pool)) {
+    pthread_cond_broadcast(&pool->foreground_done);
+  }
+}
+
+static void push_job(WorkerPool *pool, uint64_t key, Job *job) {
+  pthread_mutex_lock(&pool->lock);
+  Strand *strand = hmget(pool->strands, key);
+  if (strand == NULL) {
+    strand = calloc(1, sizeof(Strand));
+    if (!strand) {
+      fail("Out of memory");
+    }
+    strand->key = key;
+    hmput(pool->strands, key, strand);
+  }
+
+  job->next = NULL;
+  if (strand->tail) {
+    strand->tail->next = job;
+  } else {
+    strand->head = job;
+  }
+  strand->tail = job;
+  pool->unfinished++;
+  // a running strand is made ready again when its current job is done
+  if (!strand->running && strand->head == job) {
+    make_ready(pool, strand);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = arg;
+  WorkerPool *pool = worker->pool;
+  arena_enter(worker->arena);
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    Strand *strand;
+    Job *job = NULL;
+    while (!pool->stopping && (job = take_job(pool, &strand)) == NULL) {
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+    if (job == NULL) {
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    MethodPriority priority = job->priority; // the job is freed once it's run
+    run_job(pool->server, job);
+    arena_reset(worker->arena);
+
+    pthread_mutex_lock(&pool->lock);
+    finish_job(pool, strand, priority);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  arena_enter(NULL);
+  return NULL;
+}
+
+// Background work outside the pool, e.g. the indexing threads, calls it
+// between units of work with no locks held. It waits while jobs of a higher
+// priority than PRIORITY_BACKGROUND are queued or running, so those get the
+// CPU and the index first. Does nothing without a pool.
+void scheduler_yield(WorkerPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stopping && has_foreground_work(pool)) {
+    pthread_cond_wait(&pool->foreground_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+WorkerPool *create_worker_pool(Server *server, size_t count) {
+  WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+  if (!pool || !(pool->workers = calloc(count, sizeof(Worker)))) {
+    fail("Out of memory");
+  }
+  pool->server = server;
+  pool->count = count;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_cond_init(&pool->foreground_done, NULL);
+
+  for (size_t i = 0; i < count; i++) {
+    Worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->arena = create_arena();
+    if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+      fail("Couldn't start worker thread");
+    }
+  }
+  log_info("Started %zu workers", count);
+  return pool;
+}
+
+// FNV-1a of the document URI, messages without a document share strand 0
+static uint64_t document_key(Request *request) {
+  JsonSpan text_document, uri;
+  if (!json_get(request->raw_params, "textDocument", &text_document) ||
+      !json_get(text_document, "uri", &uri)) {
+    return 0;
+  }
+
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < uri.length; i++) {
+    hash = (hash ^ (unsigned char)uri.start[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// The job gets its own copy of the request, the caller still destroys it
+void submit_job(WorkerPool *pool, Client *client, Request *request, const Method *method) {
+  Job *job = calloc(1, sizeof(Job));
+  if (!job) {
+    fail("Out of memory");
+  }
+  job->request = detach_request(request);
+  job->method = method;
+  job->priority = method->priority;
+  job->client = client;
+  if (method->kind == METHOD_REQUEST && request->has_id) {
+    job->pending = register_request(client, request->id);
+  }
+  retain_client(client);
+  if (method->thread == ON_WORKER_BLOCKING) {
+    client->waiting = true;
+  }
+  push_job(pool, document_key(request), job);
+}
+
+// Tasks run one at a time, in the order they were submitted
+void submit_task(WorkerPool *pool, Task task, MethodPriority priority) {
+  Job *job = calloc(1, sizeof(Job));
+  if (!job) {
+    fail("Out of memory");
+  }
+  job->task = task;
+  job->priority = priority;
+  push_job(pool, TASK_KEY, job);
+}
+
+// Waits until every submitted job is done. Lifecycle messages run on the I/O
+// thread after it, so e.g. the shutdown response comes after the responses of
+// the requests sent before it.
+void drain_worker_pool(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->unfinished > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for the jobs being run, the queued ones are dropped
+void destroy_worker_pool(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_cond_broadcast(&pool->foreground_done);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    destroy_arena(pool->workers[i].arena);
+  }
+
+  for (ptrdiff_t i = 0; i < hmlen(pool->strands); i++) {
+    Strand *strand = pool->strands[i].value;
+    while (strand->head) {
+      Job *job = strand->head;
+      strand->head = job->next;
+      destroy_job(job);
+    }
+    free(strand);
+  }
+  hmfree(pool->strands);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->ready);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->foreground_done);
+  free(pool->workers);
+  free(pool);
+}
@@ -72,4 +72,108 @@ class BasicTest < IntegrationTest
     assert response['error'], 'Should return error for uninitialized request'
     assert_equal(-32002, response['error']['code'], 'Should be SERVER_NOT_INITIALIZED error')
   end
+
+  def test_unsupported_method
+    @client.send_request('initialize', { processId: Process.pid, capabilities: {} })
+    @client.read_response
+
+    # unknown notifications are dropped, unknown requests are answered
+    @client.send_notification('workspace/didChangeConfiguration', { settings: {} })
+    @client.send_request('textDocument/hover', {
+      textDocument: { uri: 'file:///test.rb' },
+      position: { line: 0, character: 0 }
+    })
+
+    response = @client.read_response
+    assert_equal(-32601, response['error']['code'], 'Should be MethodNotFound error')
+  end
+
+  def test_cancel_request
+    @client.send_request('initialize', { processId: Process.pid, capabilities: {} })
+    @client.read_response
+
+    id = @client.send_request('textDocument/definition', {
+      textDocument: { uri: 'file:///test.rb' },
+      position: { line: 0, character: 0 }
+    })
+    @client.send_notification('$/cancelRequest', { id: id })
+    @client.send_notification('$/cancelRequest', { id: 12_345 })
+
+    # answered either with the result or as cancelled, never twice
+    response = @client.read_response
+    assert_equal id, response['id']
+    assert_equal(-32800, response['error']['code']) if response['error']
+    @client.send_request('shutdown', {})
+    assert_nil @client.read_response['error'], 'Next response should stay in sync'
+  end
+
+  def test_indexing_progress
+    @client.send_request('initialize', {
+      processId: Process.pid,
+      rootUri: "file://#{WORKSPACE_PATH}",
+      capabilities: { window: { workDoneProgress: true } }
+    })
+    assert @client.read_response['result'], 'Initialize should answer before indexing is done'
+
+    progress = wait_for_indexing
+    assert_equal 'begin', progress.first['kind']
+    assert_equal 'end', progress.last['kind']
+    percentages = progress.filter_map { |value| value['percentage'] }
+    assert_equal percentages.sort, percentages, 'Percentage should only grow'
+    assert_operator percentages.last, :<=, 100
+
+    @client.send_request('frls/stats', {})
+    assert_operator @client.read_response['result']['sources'], :>, 0
+  end
+
+  def test_indexing_messages_without_progress
+    @client.send_request('initialize', {
+      processId: Process.pid,
+      rootUri: "file://#{WORKSPACE_PATH}",
+      capabilities: {}
+    })
+    assert @client.read_response['result']
+
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + INDEXING_TIMEOUT
+    while @client.shown_messages.size < 2
+      assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC), :<, deadline, 'Indexing should end'
+      @client.send_request('frls/stats', {})
+      @client.read_response
+      sleep 0.05
+    end
+
+    started, ended = @client.shown_messages.map { |params| params['message'] }
+    assert_includes started, 'results may be incomplete'
+    assert_match(/\AIndexing done, [1-9]\d* sources indexed\z/, ended)
+  end
+
+  def test_initialization_options_exclude
+    @client.send_request('initialize', {
+      processId: Process.pid,
+      rootUri: "file://#{WORKSPACE_PATH}",
+      capabilities: { window: { workDoneProgress: true } },
+      initializationOptions: { exclude: ['lib/project/'] }
+    })
+    @client.read_response
+    wait_for_indexing
+
+    @client.send_request('frls/stats', {})
+    indexed = Dir.glob('**/*.rb', base: WORKSPACE_PATH).reject { |path| path.start_with?('lib/project/') }
+    assert_equal indexed.size, @client.read_response['result']['sources']
+  end
+
+  def test_stats
+    @client.send_request('initialize', { processId: Process.pid, capabilities: {} })
+    @client.read_response
+
+    @client.send_request('frls/stats', {})
+    stats = @client.read_response['result']
+
+    assert_operator stats['messages'], :>=, 2
+    assert_operator stats['bytesIn'], :>, 0
+    assert_operator stats['bytesOut'], :>, 0
+    handler = stats['methods']['initialize']['handler']
+    assert_equal 1, handler['count']
+    assert_operator handler['p99Us'], :<=, handler['maxUs'] * 1.0625 + 1
+  end
 end
@@ -106,6 +106,7 @@ class DefinitionTest < IntegrationTest
       processId: Process.pid,
       rootUri: "file://#{WORKSPACE_PATH}",
       capabilities: {
+        window: { workDoneProgress: true },
         textDocument: {
           definition: { linkSupport: true },
           synchronization: {
@@ -119,6 +120,7 @@ class DefinitionTest < IntegrationTest
     })
 
     @client.read_response
+    wait_for_indexing
     @client.send_notification('initialized', {})
   end
 end
@@ -2,22 +2,36 @@ require 'socket'
 require 'json'
 
 class LSPClient
-  attr_reader :socket
+  attr_reader :socket, :shown_messages
 
-  def initialize(host: 'localhost', port: 7777)
+  # Messages sent are also written to `recorder`, a Recording::Writer from
+  # bench/recording.rb, under `client_id`
+  def initialize(host: 'localhost', port: 7777, recorder: nil, client_id: 1)
     @host = host
     @port = port
     @socket = nil
     @message_id = 0
+    @recorder = recorder
+    @client_id = client_id
+    @shown_messages = []
   end
 
   def connect
     @socket = TCPSocket.new(@host, @port)
+    @reader = @writer = @socket
+  end
+
+  # Talks over a pair of pipes, e.g. to a server started with --stdio
+  def attach(reader, writer)
+    @reader = reader
+    @writer = writer
   end
 
   def disconnect
     @socket.close if @socket
     @socket = nil
+    @writer.close if @writer && !@writer.closed?
+    @reader = @writer = nil
   end
 
   def send_request(method, params = {})
@@ -29,6 +43,7 @@ class LSPClient
       params: params
     }
     send_message(message)
+    @message_id
   end
 
   def send_notification(method, params = {})
@@ -41,17 +56,32 @@ class LSPClient
   end
 
   def send_message(message)
-    content = message.to_json
+    send_body(message.to_json)
+  end
+
+  def send_body(content)
+    @recorder&.write(@client_id, content)
     header = "Content-Length: #{content.bytesize}\r\n\r\n"
-    @socket.write(header + content)
-    @socket.flush
+    @writer.write(header + content)
+    @writer.flush
   end
 
+  # window/showMessage notifications can come in between responses, their
+  # params are kept in `shown_messages`
   def read_response
+    loop do
+      message = read_message
+      return message unless message && message['method'] == 'window/showMessage'
+
+      @shown_messages << message['params']
+    end
+  end
+
+  def read_message
     # Read headers
     headers = {}
     loop do
-      line = @socket.gets
+      line = @reader.gets
       break if line.nil? || line.strip.empty?
 
       key, value = line.split(':', 2)
@@ -62,7 +92,7 @@ class LSPClient
     content_length = headers['Content-Length'].to_i
     return nil if content_length == 0
 
-    content = @socket.read(content_length)
+    content = @reader.read(content_length)
     JSON.parse(content)
   end
 
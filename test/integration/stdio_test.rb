@@ -0,0 +1,59 @@
+require 'minitest/autorun'
+require 'open3'
+require_relative 'lsp_client'
+
+class StdioTest < Minitest::Test
+  WORKSPACE_PATH = File.expand_path('../fixtures/project', __dir__)
+
+  def setup
+    server_path = File.expand_path('../../build/frls', __dir__)
+    raise "Server binary not found at #{server_path}. Run 'make' first." unless File.exist?(server_path)
+
+    @stdin, @stdout, @wait_thread = Open3.popen2(server_path, '--stdio', err: '/dev/null')
+    @client = LSPClient.new
+    @client.attach(@stdout, @stdin)
+  end
+
+  def teardown
+    @client.disconnect
+    Process.kill('TERM', @wait_thread.pid) rescue nil
+    @wait_thread.join
+  end
+
+  def test_initialize_over_stdio
+    @client.send_request('initialize', {
+      processId: Process.pid,
+      rootUri: "file://#{WORKSPACE_PATH}",
+      capabilities: {}
+    })
+
+    response = @client.read_response
+    assert response['result'], 'Initialize should return result'
+    assert response['result']['capabilities'], 'Should have capabilities'
+  end
+
+  def test_exits_when_stdin_is_closed
+    @client.send_request('initialize', { processId: Process.pid, capabilities: {} })
+    @client.read_response
+    @client.send_request('shutdown', {})
+    @client.read_response
+
+    @stdin.close
+    assert_equal 0, @wait_thread.value.exitstatus, 'Server should exit cleanly after shutdown'
+  end
+
+  def test_exit_notification_after_shutdown
+    @client.send_request('initialize', { processId: Process.pid, capabilities: {} })
+    @client.read_response
+    @client.send_request('shutdown', {})
+    @client.read_response
+
+    # notifications after shutdown are dropped, requests are refused
+    @client.send_notification('textDocument/didClose', { textDocument: { uri: 'file:///a.rb' } })
+    @client.send_request('textDocument/definition', {})
+    assert_equal(-32600, @client.read_response['error']['code'])
+
+    @client.send_notification('exit')
+    assert_equal 0, @wait_thread.value.exitstatus, 'Server should exit cleanly after shutdown'
+  end
+end
@@ -1,15 +1,23 @@
 require 'minitest/autorun'
 require 'fileutils'
+require 'timeout'
 require_relative 'lsp_client'
+require_relative '../../bench/recording'
 
 class IntegrationTest < Minitest::Test
   SERVER_HOST = 'localhost'
   SERVER_PORT = 7778
   WORKSPACE_PATH = File.expand_path('../fixtures/project', __dir__)
 
+  # FRLS_RECORD=<dir> saves what every test sends as a recording for
+  # bench/replay.rb
   def setup
     start_server
-    @client = LSPClient.new(host: SERVER_HOST, port: SERVER_PORT)
+    if ENV['FRLS_RECORD']
+      FileUtils.mkdir_p(ENV['FRLS_RECORD'])
+      @recorder = Recording::Writer.new(File.join(ENV['FRLS_RECORD'], "#{name}.rec"))
+    end
+    @client = LSPClient.new(host: SERVER_HOST, port: SERVER_PORT, recorder: @recorder)
 
     # Give server time to start
     max_attempts = 10
@@ -31,6 +39,7 @@ class IntegrationTest < Minitest::Test
 
   def teardown
     @client.disconnect if @client
+    @recorder&.close
     stop_server
   end
 
@@ -62,6 +71,30 @@ class IntegrationTest < Minitest::Test
     end
   end
 
+  INDEXING_TIMEOUT = 30
+
+  # Indexing runs after the initialize response, clients that advertise
+  # window.workDoneProgress get its progress. Answers the create request and
+  # returns the $/progress values up to `end`.
+  def wait_for_indexing(timeout: INDEXING_TIMEOUT)
+    values = []
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+    loop do
+      remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      raise "Indexing didn't end within #{timeout}s" if remaining <= 0
+
+      message = Timeout.timeout(remaining, Minitest::Assertion) { @client.read_response }
+      raise 'Server closed the connection while indexing' unless message
+
+      if message['method'] == 'window/workDoneProgress/create'
+        @client.send_message({ jsonrpc: '2.0', id: message['id'], result: nil })
+      elsif message['method'] == '$/progress'
+        values << message['params']['value']
+        return values if values.last['kind'] == 'end'
+      end
+    end
+  end
+
   def build_file_uri(file_path)
     "file://#{File.expand_path(file_path, WORKSPACE_PATH)}"
   end
@@ -0,0 +1,106 @@
+require 'timeout'
+require_relative 'test_helper'
+
+class TransportTest < IntegrationTest
+  def test_message_split_across_writes
+    content = initialize_message.to_json
+    frame = "Content-Length: #{content.bytesize}\r\n\r\n#{content}"
+
+    frame.chars.each_slice(frame.bytesize / 4 + 1) do |chunk|
+      @client.socket.write(chunk.join)
+      @client.socket.flush
+      sleep 0.05
+    end
+
+    response = @client.read_response
+    assert response['result'], 'Initialize should succeed when split across writes'
+  end
+
+  def test_large_document
+    @client.send_message(initialize_message)
+    @client.read_response
+    @client.send_notification('initialized', {})
+
+    file_uri = build_file_uri('lib/generated.rb')
+    text = (1..5_000).map { |i| "class Generated#{i}; def call = #{i}; end\n" }.join
+    assert text.bytesize > 200_000
+
+    @client.send_notification('textDocument/didOpen', {
+      textDocument: { uri: file_uri, languageId: 'ruby', version: 1, text: text }
+    })
+    @client.send_request('textDocument/definition', {
+      textDocument: { uri: file_uri },
+      position: { line: 0, character: 8 }
+    })
+
+    response = @client.read_response
+    refute_nil response, 'Should receive response after a large didOpen'
+    assert_nil response['error']
+  end
+
+  def test_pipelined_messages_in_one_write
+    frames = [
+      initialize_message,
+      { jsonrpc: '2.0', method: 'initialized', params: {} },
+      { jsonrpc: '2.0', id: 2, method: 'textDocument/definition', params: {} },
+      { jsonrpc: '2.0', id: 3, method: 'shutdown', params: {} }
+    ].map do |message|
+      content = message.to_json
+      "Content-Length: #{content.bytesize}\r\n\r\n#{content}"
+    end
+    @client.socket.write(frames.join)
+    @client.socket.flush
+
+    assert @client.read_response['result'], 'Initialize should succeed'
+    assert_equal 2, @client.read_response['id']
+    assert_equal 3, @client.read_response['id']
+  end
+
+  def test_large_response_is_not_truncated
+    @client.send_message(initialize_message)
+    @client.read_response
+
+    # invalid params are echoed back in the error message
+    padding = 'x' * 300_000
+    @client.send_request('textDocument/definition', { padding: padding })
+    @client.send_request('shutdown', {})
+
+    response = @client.read_response
+    assert_includes response['error']['message'], padding
+    assert_nil @client.read_response['error'], 'Next response should stay in sync'
+  end
+
+  def test_stalled_client_does_not_block_others
+    @client.send_message(initialize_message)
+    @client.read_response
+
+    # responses pile up far beyond the socket buffers and the high-water mark
+    padding = 'x' * 300_000
+    40.times { |i| @client.send_request('textDocument/definition', { padding: padding, i: i }) }
+
+    other = LSPClient.new(host: SERVER_HOST, port: SERVER_PORT)
+    other.connect
+    other.send_request('textDocument/definition', {
+      textDocument: { uri: build_file_uri('lib/project.rb') },
+      position: { line: 0, character: 0 }
+    })
+    response = Timeout.timeout(5) { other.read_response }
+    assert_nil response['error']
+    other.disconnect
+
+    40.times do
+      assert_includes @client.read_response['error']['message'], padding
+    end
+  end
+
+  private
+
+  def initialize_message
+    {
+      jsonrpc: '2.0',
+      id: 1,
+      method: 'initialize',
+      params: { processId: Process.pid, rootUri: "file://#{WORKSPACE_PATH}", capabilities: {} }
+    }
+  end
+end